@@ -0,0 +1,236 @@
+/* pidgrid-agent.c, Copyright (c) 2022 Robbie Huffman <robbie.huffman@nundrum.net>
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation.  No representations are made about the suitability of this
+ * software for any purpose.  It is provided "as is" without express or
+ * implied warranty.
+ *
+ * Samples this machine's process table with get_all_procs() and serves
+ * it to pidgrid -fleet: each viewer gets the whole table when it
+ * connects, then only new and gone pids and changed fields (see
+ * utils/procstream.h).
+ *
+ *   pidgrid-agent [-listen [host:]port | /path/to/socket] [-interval secs]
+ *                 [-name name] [-root dir] [-filter spec] [-uring] [-v]
+ *
+ * -root samples a copy of /proc instead, which is how to run a rack's
+ * worth of agents on one box for testing.  -filter takes the same spec
+ * as pidgrid's.  -v prints stream sizes every few seconds.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "utils/procs.c"
+#include "utils/procstream.c"
+
+#define MAXPROCS 32768
+#define MAXCLIENTS 64
+#define MAXBACKLOG (4 << 20)	/* bytes queued for a viewer before it's dropped */
+
+struct client {
+	int fd;
+	unsigned char *out;
+	size_t len, cap;
+};
+
+static struct client clients[MAXCLIENTS];
+static int nclients;
+static const char *progname = "pidgrid-agent";
+
+static int client_queue(struct client *c, const unsigned char *data, size_t len) {
+	unsigned char *grown;
+	size_t cap;
+
+	if (c->len + len > MAXBACKLOG) return -1;
+	if (c->len + len > c->cap) {
+		for (cap = c->cap ? c->cap : 65536; cap < c->len + len; cap *= 2)
+			;
+		if (!(grown = realloc(c->out, cap))) return -1;
+		c->out = grown;
+		c->cap = cap;
+	}
+	memcpy(c->out + c->len, data, len);
+	c->len += len;
+	return 0;
+}
+
+static int client_flush(struct client *c) {
+	ssize_t n;
+	while (c->len) {
+		n = send(c->fd, c->out, c->len, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return errno == EAGAIN ? 0 : -1;
+		}
+		memmove(c->out, c->out + n, c->len - n);
+		c->len -= n;
+	}
+	return 0;
+}
+
+static void client_drop(int i) {
+	close(clients[i].fd);
+	free(clients[i].out);
+	clients[i] = clients[--nclients];
+}
+
+static unsigned long long agent_now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage(void) {
+	fprintf(stderr, "usage: %s [-listen [host:]port | /path] [-interval secs]"
+			" [-name name] [-root dir] [-filter spec] [-uring] [-v]\n", progname);
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	static proc_t cur[MAXPROCS];
+	struct pstream_table prev;
+	struct pollfd pfd[MAXCLIENTS + 1];
+	unsigned char *frame = NULL, hello[80];
+	size_t framecap = 0, len, hellolen, need;
+	const char *listen_addr = NULL, *root = NULL, *filter = NULL;
+	char name[64], port[16];
+	double interval = 0.05;
+	unsigned long long next, now, window_start;
+	unsigned long seq = 0, wsamples = 0, wbytes = 0;
+	int verbose = 0, uring = 0;
+	int lfd, fd, i, n, timeout;
+
+	gethostname(name, sizeof name);
+	name[sizeof name - 1] = '\0';
+	for (i=1; i<argc; i++) {
+		if (!strcmp(argv[i], "-v")) verbose = 1;
+		else if (!strcmp(argv[i], "-uring")) uring = 1;
+		else if (i + 1 == argc) usage();
+		else if (!strcmp(argv[i], "-listen")) listen_addr = argv[++i];
+		else if (!strcmp(argv[i], "-interval")) interval = atof(argv[++i]);
+		else if (!strcmp(argv[i], "-name")) snprintf(name, sizeof name, "%s", argv[++i]);
+		else if (!strcmp(argv[i], "-root")) root = argv[++i];
+		else if (!strcmp(argv[i], "-filter")) filter = argv[++i];
+		else usage();
+	}
+	if (interval < 0.01) interval = 0.01;
+	if (!listen_addr) {
+		snprintf(port, sizeof port, "%d", PSTREAM_PORT);
+		listen_addr = port;
+	}
+
+	if (root && procs_set_root(root) < 0) {
+		fprintf(stderr, "%s: -root too long\n", progname);
+		return 1;
+	}
+	if (filter && procs_set_filter(filter) < 0) {
+		fprintf(stderr, "%s: bad -filter \"%s\"\n", progname, filter);
+		return 1;
+	}
+	if (uring && !procs_use_uring(1))
+		fprintf(stderr, "%s: io_uring unavailable, using plain reads\n", progname);
+	if ((lfd = pstream_listen(listen_addr)) < 0) {
+		fprintf(stderr, "%s: can't listen on %s: %s\n", progname, listen_addr,
+				strerror(errno));
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	memset(&prev, 0, sizeof prev);
+	hellolen = pstream_encode_hello(hello, name);
+	window_start = next = agent_now_ns();
+
+	for (;;) {
+		now = agent_now_ns();
+		if (now >= next) {
+			n = pstream_sort(cur, get_all_procs(cur, MAXPROCS));
+			need = pstream_bound(prev.n, n);
+			if (need > framecap) {
+				free(frame);
+				if (!(frame = malloc(framecap = need))) {
+					fprintf(stderr, "%s: out of memory\n", progname);
+					return 1;
+				}
+			}
+			/* an empty delta still goes out; it marks a sample */
+			len = pstream_encode(frame, &prev, cur, n, ++seq, 0);
+			for (i=0; i<nclients; i++)
+				if (client_queue(&clients[i], frame, len) < 0 ||
+						client_flush(&clients[i]) < 0) {
+					if (verbose) fprintf(stderr, "%s: dropping a slow viewer\n", progname);
+					client_drop(i--);
+				}
+			pstream_table_set(&prev, cur, n);
+			wsamples++;
+			wbytes += len;
+
+			next += interval * 1e9;
+			if (next < now) next = now + interval * 1e9;
+			if (verbose && now - window_start >= 5000000000ULL) {
+				fprintf(stderr, "%s: %d procs, %.1f bytes/sample, %d viewers\n",
+						progname, n, (double) wbytes / wsamples, nclients);
+				window_start = now;
+				wsamples = wbytes = 0;
+			}
+		}
+
+		pfd[0].fd = lfd;
+		pfd[0].events = POLLIN;
+		for (i=0; i<nclients; i++) {
+			pfd[i + 1].fd = clients[i].fd;
+			pfd[i + 1].events = POLLIN | (clients[i].len ? POLLOUT : 0);
+		}
+		now = agent_now_ns();
+		timeout = next > now ? (next - now + 999999) / 1000000 : 0;
+		if (poll(pfd, nclients + 1, timeout) < 0) continue;
+
+		/* walk backwards so dropping one doesn't skip another */
+		for (i=nclients-1; i>=0; i--) {
+			char discard[256];
+			if (pfd[i + 1].revents & (POLLIN | POLLHUP | POLLERR)) {
+				n = read(clients[i].fd, discard, sizeof discard);
+				if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+					client_drop(i);
+					continue;
+				}
+			}
+			if ((pfd[i + 1].revents & POLLOUT) && client_flush(&clients[i]) < 0)
+				client_drop(i);
+		}
+
+		if (pfd[0].revents & POLLIN) {
+			if ((fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0) continue;
+			if (nclients == MAXCLIENTS) { close(fd); continue; }
+			memset(&clients[nclients], 0, sizeof *clients);
+			clients[nclients].fd = fd;
+			/* catch it up: who we are, then the table as last sampled */
+			need = pstream_bound(0, prev.n);
+			if (need > framecap) {
+				free(frame);
+				if (!(frame = malloc(framecap = need))) {
+					fprintf(stderr, "%s: out of memory\n", progname);
+					return 1;
+				}
+			}
+			len = pstream_encode(frame, &prev, prev.procs, prev.n, seq, 1);
+			if (client_queue(&clients[nclients], hello, hellolen) < 0 ||
+					client_queue(&clients[nclients], frame, len) < 0) {
+				close(fd);
+				free(clients[nclients].out);
+				continue;
+			}
+			nclients++;
+			client_flush(&clients[nclients - 1]);
+		}
+	}
+}
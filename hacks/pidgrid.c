@@ -15,6 +15,48 @@
  * the RSS of the most recent snapshot. Colors represent ownership
  * by root, nobody, system users, and human users.
  *
+ * With -mode cpu, segment widths show CPU use over each sample
+ * interval instead of RSS.  -mode pss and -mode uss size by
+ * proportional or unshared memory from smaps_rollup; reading that is
+ * slow, so each sample spends at most -mem-budget microseconds on
+ * it, and rows between readings scale their RSS by the last ratio.
+ *
+ * With -layout tree, rows are indented under their parent process,
+ * and -collapse N folds everything below depth N into one row sized
+ * by the subtree's total RSS.  -layout rss, oom or growth sorts rows
+ * by that key, and -top K shows only the first K of them.  -uring
+ * samples /proc through io_uring, keeping each process's files open
+ * and batching the reads.
+ *
+ * -filter limits the scan to matching processes, e.g.
+ *   -filter "uid=1000-1999,33 comm=nginx*,php-fpm* rss=2560 state=RD"
+ * Terms are uid numbers or ranges, command name globs, a minimum RSS
+ * in pages and wanted states; a process must pass every term given.
+ *
+ * -fleet "host1:7711 host2 /run/pg.sock" shows the process tables
+ * that pidgrid-agent serves from those machines instead of this one's,
+ * each host's rows under its name.  The sorted layouts rank across the
+ * whole fleet.  Filters go on the agents.
+ *
+ * /proc is sampled as often as it's changing: each sample's churn, the
+ * share of rows that appeared, exited or whose stat line differs from
+ * the last one, moves the interval between -sample-min and -sample-max
+ * seconds.  Set them equal for a fixed rate.  Gaps between segments
+ * are spaced by the time between samples.
+ *
+ * -labels puts each row's pid, name and current size (or CPU, or OOM
+ * score) at its left end, as many as fit without overlapping.  Labels
+ * are rendered once into a pixmap atlas of -label-cache kilobytes and
+ * copied from there each frame, so a steady row costs one XCopyArea;
+ * the least recently drawn are evicted when it fills.  -label-cache 0
+ * draws the text every frame instead.
+ *
+ * Build with -DPIDGRID_STATS to get the -stats overlay and the
+ * -stats-file periodic dump of sampler and frame timings.  That build
+ * also counts heap allocations: with -alloc-check N, any frame after
+ * the N'th that allocates ends the run with status 1, and
+ * -stats-frames M ends it with 0 after M frames.
+ *
  */
 
 #define _GNU_SOURCE
@@ -22,7 +64,7 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include "utils/procs.c"
-#include <search.h>
+#include "utils/procstream.c"
 
 #ifdef HAVE_DOUBLE_BUFFER_EXTENSION
 # include "xdbe.h"
@@ -36,17 +78,128 @@
 #define USERS 1000
 #define NOBODY 65534
 
-#define MAXPROCS 1000
+#define SCANPROCS 1024		/* first size of the scan buffer, which grows */
+#define MAXROWS 65536		/* history rows, all hosts together */
+#define MAXFLEET 64
+#define ROWHASH 65536		/* buckets for finding rows, a power of two */
+#define ROWSLAB 64		/* rows allocated at a time */
+
+#ifdef PIDGRID_STATS
+# include <malloc.h>
+# include "utils/allocs.c"
+# define STATFRAMES 128		/* frames kept for percentiles */
+
+enum stattimers { T_SCAN, T_PARSE, T_MEM, T_HIST, T_DRAW, NTIMERS };
+static const char *stattimer_names[NTIMERS] = { "scan", "parse", "mem", "hist", "draw" };
+
+/* The sampler's timers and counters only move on frames that take a
+   sample; between those, the last sample's figures stand. */
+struct frame_stats {
+	unsigned long long t[NTIMERS][STATFRAMES];	/* ns, one ring per timer */
+	unsigned long long cur[NTIMERS];		/* this frame so far */
+	unsigned long long mark;
+	int frame[NTIMERS], frames[NTIMERS];		/* each ring's next slot, and fill */
+	int samples;					/* taken this frame */
+	struct procs_stats procs;			/* sampler, last sample */
+	unsigned long xreq_start, xrequests;		/* X requests, last frame */
+	int rows;					/* live history rows */
+	unsigned long heap;				/* bytes malloc'ed */
+	unsigned long long ttff;			/* init to first frame on screen, ns */
+	unsigned long label_hits, label_misses;		/* last frame */
+	unsigned long alloc_start, allocs;		/* heap allocations, last frame */
+	int alloc_check;	/* frames of warm-up, after which allocating fails */
+	int max_frames;		/* end the run after this many, 0 for never */
+	Bool hud;
+	FILE *dump;
+	int interval;
+	time_t nextdump;
+};
+
+# define STATS_MARK(st)		((st)->stats.mark = now_ns())
+# define STATS_LAP(st, timer)	stats_lap(&(st)->stats, timer)
+# define STATS_ADD(st, field, n)	((st)->stats.field += (n))
+#else
+# define STATS_MARK(st)		((void) 0)
+# define STATS_LAP(st, timer)	((void) 0)
+# define STATS_ADD(st, field, n)	((void) 0)
+#endif /* PIDGRID_STATS */
+
+enum colorclasses { C_USERS, C_ROOT, C_SYSTEM, C_NOBODY, NCLASSES };
+#define NPALETTES (NCLASSES * 2)	/* each class has a high OOM score twin */
+#define PALETTESIZE 100
+#define LABELCHARS 28		/* label cell width, in characters */
+
+/* Per-row drawing layout, kept in step with the history ring so that
+ * drawing a row doesn't have to re-derive it.  segw[] holds each slot's
+ * drawn width; the newest viscount slots, summing to hsize, are the
+ * ones that fit across the window.  Updated on every push and rebuilt
+ * from scratch only when the window is reshaped.
+ */
+struct row_layout {
+	int segw[MAXHIST];
+	int hsize;
+	int viscount;
+	int palette;		/* index into st->palettes */
+	int height;		/* bar height in pixels */
+};
 
 struct proc_t_history {
+	int host;		/* 0 here, else 1 + index into st->fleet */
 	int tid;
+	int ppid;		/* parent it is linked under in the forest */
 	bool present;
 	bool visible;
-	proc_t processes[MAXHIST];
+	bool linked;		/* has a place in the forest */
+	long sortkey;		/* for the sorted layouts */
+	bool resort;		/* new, or sortkey moved since order_update */
+	int rank;		/* index in st->order, or -1 */
+	struct proc_t_history *parent;
+	struct proc_t_history *first_child, *last_child;
+	struct proc_t_history *prev, *next;	/* siblings, in pid order */
+	struct row_layout layout;
+	proc_t latest;			/* newest full sample */
+	unsigned int age;		/* samples pushed since the row appeared */
+	unsigned long long ticks;	/* utime + stime as of ticks_ns */
+	unsigned long long ticks_ns;
+	unsigned long mem;		/* last PSS or USS reading, pages */
+	unsigned long mem_rss;		/* RSS at that reading */
+	unsigned int mem_age;		/* age at that reading */
+	bool mem_read;
+	bool mem_failed;		/* smaps_rollup won't open; RSS it is */
+	int label;			/* cell in st->label_cells, or -1 */
+	struct proc_t_history *hnext;	/* hash chain, or the free list */
+
+	/* the history ring, one column per field the drawing uses */
+	unsigned long rss[MAXHIST];
+	char state[MAXHIST];
+	unsigned short *cpu;	/* permille of one CPU; NULL without PF_CPU */
 };
 
+enum rendermodes { M_RSS, M_CPU, M_PSS, M_USS };
+#define MEMMODE(st) ((st)->mode >= M_PSS)
+enum layouts { L_PID, L_TREE, L_RSS, L_OOM, L_GROWTH };
+#define SORTED(st) ((st)->layout >= L_RSS)
+#define GROWTHSPAN 10	/* samples to measure RSS growth over */
+#define CHURN_FAST 8	/* percent of rows new, gone or changed: sample sooner */
+#define CHURN_SLOW 2	/* and below this, later */
+
 enum detailstates { waiting, growing, showing, shrinking, newpid };
 
+struct row_slab {
+	struct row_slab *next;
+	struct proc_t_history rows[ROWSLAB];
+	unsigned short cpu[][MAXHIST];	/* the rows' cpu columns, if wanted */
+};
+
+/* One cell of the label atlas, on a list from most to least recently
+   drawn. */
+struct label {
+	struct proc_t_history *owner;	/* row it was rendered for, or NULL */
+	char text[LABELCHARS + 16];	/* what the cell holds */
+	int width;			/* pixels of it worth copying */
+	int newer, older;		/* indices into st->label_cells, -1 at the ends */
+};
+
 struct state {
 	Display *dpy;
 	Window window;
@@ -60,27 +213,17 @@ struct state {
 #endif /* HAVE_DOUBLE_BUFFER_EXTENSION */
 
 	XColor colors[255];
-	XColor c_root[100];
-	XColor c_root_oom[100];
-	XColor c_nobody[100];
-	XColor c_nobody_oom[100];
-	XColor c_system[100];
-	XColor c_system_oom[100];
-	XColor c_sys[SYSMAX - SYSMIN + 1];
-	XColor c_users[200];
-	XColor c_users_oom[200];
-
-	int c_user_current;
-	int c_root_current;
-	int c_system_current;
-	int c_nobody_current;
+	XColor palettes[NPALETTES][PALETTESIZE];	/* filled on first use */
+	Bool palette_ready[NPALETTES];
+	int hues[NCLASSES];
+	int c_current[NCLASSES];
 	int ncolors;
 	int max_depth;
 	int min_height;
 	int min_width;
 	int line_width;
 
-	XftFont *font;
+	XftFont *font;			/* loaded when text is first drawn */
 	XftColor xft_fg;
 	XftDraw *xftdraw;
 	const char *s;
@@ -98,6 +241,19 @@ struct state {
 
 	int history_index;
 	int history_index_last;
+	unsigned long long sampled_ns[MAXHIST];	/* when each slot was sampled */
+	unsigned int slot_ms[MAXHIST];		/* since the sample before it */
+	unsigned long long slot_cum_ms[MAXHIST];	/* running total of slot_ms */
+	unsigned long long cum_ms;
+	int nsamples;				/* slots filled, up to MAXHIST */
+
+	/* the sampling cadence, steered by churn between the two limits */
+	unsigned long long sample_min, sample_max;	/* ns */
+	unsigned long long interval, next_sample;	/* ns */
+	int spawned, changed;		/* rows new, or with a new stat line, this sample */
+	int churn;			/* percent of rows new, gone or changed */
+	long hz;				/* clock ticks per second */
+	unsigned fields;			/* PF_ stat fields the mode needs */
 
 	int lastx;
 	int currenty;
@@ -110,75 +266,482 @@ struct state {
 
 	enum detailstates detailstate;
 	int detailpid;
+	int detailhost;		/* pids repeat across -fleet hosts */
 	int detailsize;
 	int showtime;
 
-	void *pidtree;
-	int nodecount;
-	int nth;
-
+	/* Rows come from slabs that are kept for reuse, and are found by
+	   hash; nothing here allocates once the slabs cover the most rows
+	   there have been. */
+	struct proc_t_history *live[MAXROWS];	/* in (host, pid) order */
+	int nlive;
+	struct proc_t_history *rowhash[ROWHASH];
+	struct proc_t_history *freerows;
+	struct row_slab *slabs;
+
+	int layout;
+	int collapse;		/* collapse subtrees below this depth, -1 for never */
+	int indent;		/* pixels per tree level */
+	struct proc_t_history *first_root, *last_root;
+	struct proc_t_history *gone[MAXROWS];	/* rows whose pid went away this scan */
+	struct proc_t_history *relink[MAXROWS];	/* rows whose parent may have changed */
+	int nrelink;
+	int ngone;
+	proc_t *scan;		/* get_all_procs_detail's buffer */
+	int scancap;
+
+	unsigned long long init_ns;	/* when pidgrid_init started */
+	int frames;		/* drawn so far */
+	Bool want_uring;
+
+	unsigned long long mem_budget;	/* ns per sample for smaps_rollup */
+	struct mem_candidate { long priority; struct proc_t_history *pth; }
+		memq[MAXROWS];
+	int nmemq;
+
+	struct pstream_conn *fleet;	/* -fleet agents, instead of our own /proc */
+	int nfleet;
+	int group_host;		/* host of the rows being drawn */
+
+	Bool labels;
+	unsigned long label_cap;	/* atlas bytes, 0 to draw text every frame */
+	Pixmap label_atlas;		/* made when the first label is drawn */
+	XftDraw *label_draw;
+	GC label_gc;
+	struct label *label_cells;
+	int nlabels, label_cols;	/* cells, and cells per atlas row */
+	int label_w, label_h;		/* cell size, pixels */
+	int label_newest, label_oldest;
+	int label_bottom;		/* y under the last label this frame */
+	long page_kb;
+
+	int top;		/* rows shown by the sorted layouts, 0 for all */
+	struct proc_t_history *order[MAXROWS * 2];	/* rows by sortkey */
+	int norder;
+	struct proc_t_history *resorted[MAXROWS * 2];	/* order_update's scratch */
+
+#ifdef PIDGRID_STATS
+	struct frame_stats stats;
+#endif
 };
 
-static void walk_and_count(const void *what, const VISIT which, void *closure) {
-	struct proc_t_history *pth;
-	struct state *st;
-	st = (struct state*) closure;
-	pth = *(struct proc_t_history **)what;
-	switch (which) {
-		case preorder: return;
-		case endorder: return;
-		case postorder:
-		case leaf: ;
+static unsigned long long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* The font is only needed once a detail line or the stats overlay
+ * shows up, so it isn't loaded until then. */
+static Bool load_font(struct state *st) {
+	char *fontname;
+	XGlyphInfo overall;
+	char ascii[95];
+	int i;
+
+	if (st->font) return True;
+	fontname = get_string_resource (st->dpy, "font", "Font");
+	if (!fontname) fontname = strdup("HeavyData Nerd Font 10");
+	st->font = load_xft_font_retry(st->dpy, screen_number (st->xgwa.screen), fontname);
+	if (!st->font) abort();
+	if (fontname) free (fontname);
+
+	XftTextExtentsUtf8 (st->dpy, st->font, (FcChar8 *) "N", 1, &overall);
+	st->char_width = overall.xOff;
+	st->line_height = st->font->ascent + st->font->descent + 1;
+
+	/* load the printable ASCII glyphs now rather than piecemeal, in
+	   whichever frame first draws each one */
+	for (i=0; i<sizeof ascii; i++) ascii[i] = ' ' + i;
+	XftTextExtentsUtf8 (st->dpy, st->font, (FcChar8 *) ascii, sizeof ascii, &overall);
+	return True;
+}
+
+static unsigned long mask_pixel(unsigned long mask, unsigned short value) {
+	int shift = 0, bits = 0;
+	if (!mask) return 0;
+	while (!(mask & 1)) { mask >>= 1; shift++; }
+	while (mask & 1) { mask >>= 1; bits++; }
+	if (bits > 16) bits = 16;
+	return ((unsigned long) (value >> (16 - bits))) << shift;
+}
+
+/* Palettes are made the first time a row of their class is drawn.  On
+ * TrueColor the pixels come from the visual's masks without a trip to
+ * the server; elsewhere make_color_loop allocates them then. */
+static void make_palette(struct state *st, int pal) {
+	XColor *colors = st->palettes[pal];
+	int hue = st->hues[pal / 2];
+	double s = (pal & 1) ? 0.5 : 1.0;
+	int colorcount = PALETTESIZE, i;
+	Bool truecolor = visual_class(st->xgwa.screen, st->xgwa.visual) == TrueColor;
+	unsigned long rmask, gmask, bmask;
+
+	make_color_loop(st->xgwa.screen, st->xgwa.visual, st->xgwa.colormap,
+			hue, s, 1.0,
+			hue, s, 0.5,
+			hue, s, 0.4,
+			colors, &colorcount, !truecolor, false);
+	if (truecolor) {
+		visual_rgb_masks(st->xgwa.screen, st->xgwa.visual, &rmask, &gmask, &bmask);
+		for (i=0; i<colorcount; i++)
+			colors[i].pixel = mask_pixel(rmask, colors[i].red) |
+				mask_pixel(gmask, colors[i].green) |
+				mask_pixel(bmask, colors[i].blue);
 	}
-	if (!pth->visible) return;
-	st->nodecount++;
+	st->palette_ready[pal] = True;
 }
 
-static void walk_and_choose(const void *what, const VISIT which, void *closure) {
-	struct proc_t_history *pth;
-	struct state *st;
-	st = (struct state*) closure;
-	pth = *(struct proc_t_history **)what;
-	switch (which) {
-		case preorder: return;
-		case endorder: return;
-		case postorder:
-		case leaf: ;
+static inline unsigned long palette_pixel(struct state *st, int pal, int i) {
+	if (!st->palette_ready[pal]) make_palette(st, pal);
+	return st->palettes[pal][i].pixel;
+}
+
+#ifdef PIDGRID_STATS
+static void stats_lap(struct frame_stats *fs, int timer) {
+	unsigned long long now = now_ns();
+	fs->cur[timer] += now - fs->mark;
+	fs->mark = now;
+}
+
+/* pct'th percentile of a timer over the last STATFRAMES frames, in us.
+   Sorted by hand: glibc's qsort may malloc a buffer this size. */
+static unsigned long stats_pct(struct frame_stats *fs, int timer, int pct) {
+	unsigned long long v[STATFRAMES], t;
+	int i, j;
+	if (fs->frames[timer] == 0) return 0;
+	for (i=0; i<fs->frames[timer]; i++) {
+		t = fs->t[timer][i];
+		for (j = i; j > 0 && v[j - 1] > t; j--) v[j] = v[j - 1];
+		v[j] = t;
 	}
-	if (!pth->visible) return;
-	st->nodecount++;
-	if (st->nodecount == st->nth) {
-		st->detailpid = pth->tid;
+	return v[(fs->frames[timer] - 1) * pct / 100] / 1000;
+}
+
+static void stats_record(struct frame_stats *fs, int timer) {
+	fs->t[timer][fs->frame[timer]] = fs->cur[timer];
+	if (++fs->frame[timer] == STATFRAMES) fs->frame[timer] = 0;
+	if (fs->frames[timer] < STATFRAMES) fs->frames[timer]++;
+}
+
+static void stats_begin_frame(struct state *st) {
+	struct frame_stats *fs = &st->stats;
+	memset(fs->cur, 0, sizeof fs->cur);
+	memset(&procs_stats, 0, sizeof procs_stats);
+	fs->label_hits = fs->label_misses = 0;
+	fs->samples = 0;
+	fs->alloc_start = allocs_count;
+	fs->xreq_start = XNextRequest(st->dpy);
+}
+
+static void stats_end_frame(struct state *st) {
+	struct frame_stats *fs = &st->stats;
+	int i;
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+	struct mallinfo2 mi = mallinfo2();
+#else
+	struct mallinfo mi = mallinfo();
+#endif
+
+	if (fs->samples) {
+		fs->procs = procs_stats;
+		fs->cur[T_PARSE] = procs_stats.parse_ns;
+		fs->cur[T_SCAN] -= (fs->cur[T_SCAN] > procs_stats.parse_ns)
+			? procs_stats.parse_ns : fs->cur[T_SCAN];
+		for (i=0; i<NTIMERS; i++)
+			if (i != T_DRAW) stats_record(fs, i);
 	}
+	stats_record(fs, T_DRAW);
+
+	fs->xrequests = XNextRequest(st->dpy) - fs->xreq_start;
+	fs->heap = mi.uordblks;
 }
 
-static void walk_and_draw(const void *what, const VISIT which, void *closure){
-	struct proc_t_history *pth;
-	struct state *st;
-	int i, ii, x, y, segw, height, spacing, totheight;
-	int hsize, gap, viscount; /* variables  for bar segments */
-	char text[1000] = {'\0'};
-	char name[100] = {'\0'};
-	int textsize;
+static void stats_draw_hud(struct state *st) {
+	struct frame_stats *fs = &st->stats;
+	char text[NTIMERS + 4][120];
+	int i, lines, len, y;
+
+	if (!fs->hud) return;
+
+	lines = 0;
+	sprintf(text[lines++], "procs %lu/%lu  filtered %lu  syscalls %lu  bytes %lu",
+			fs->procs.procs, fs->procs.scanned, fs->procs.filtered,
+			fs->procs.syscalls, fs->procs.bytes);
+	for (i=0; i<NTIMERS; i++)
+		sprintf(text[lines++], "%-5s p50 %6lu us  p99 %6lu us",
+				stattimer_names[i], stats_pct(fs, i, 50), stats_pct(fs, i, 99));
+	sprintf(text[lines++], "xreq %lu  rows %d  slots %d  heap %lu  allocs %lu",
+			fs->xrequests, fs->rows, fs->rows * MAXHIST, fs->heap, fs->allocs);
+	sprintf(text[lines++], "first frame %llu us  labels %lu hit %lu drawn",
+			fs->ttff / 1000, fs->label_hits, fs->label_misses);
+	sprintf(text[lines++], "interval %llu ms  churn %d%%  new %d  changed %d",
+			st->interval / 1000000, st->churn, st->spawned, st->changed);
+
+	if (!load_font(st)) return;
+	XFillRectangle(st->dpy, st->b, st->bgc, 0, 0,
+			st->char_width * 48, st->line_height * lines + 4);
+	y = st->font->ascent + 2;
+	for (i=0; i<lines; i++) {
+		len = strlen(text[i]);
+		XftDrawStringUtf8(st->xftdraw, &st->xft_fg, st->font,
+				4, y, (FcChar8 *) text[i], len);
+		y += st->line_height;
+	}
+}
 
-	spacing = 3;
+/* one machine-readable line every statsInterval seconds */
+static void stats_dump(struct state *st) {
+	struct frame_stats *fs = &st->stats;
+	time_t now;
+	int i;
+
+	if (!fs->dump) return;
+	now = time(NULL);
+	if (now < fs->nextdump) return;
+	fs->nextdump = now + fs->interval;
+
+	fprintf(fs->dump, "pidgrid-stats time=%ld scanned=%lu procs=%lu filtered=%lu syscalls=%lu bytes=%lu",
+			(long) now, fs->procs.scanned, fs->procs.procs, fs->procs.filtered,
+			fs->procs.syscalls, fs->procs.bytes);
+	for (i=0; i<NTIMERS; i++)
+		fprintf(fs->dump, " %s_p50_us=%lu %s_p99_us=%lu",
+				stattimer_names[i], stats_pct(fs, i, 50),
+				stattimer_names[i], stats_pct(fs, i, 99));
+	fprintf(fs->dump, " xreq=%lu rows=%d slots=%d heap=%lu allocs=%lu ttff_us=%llu"
+			" label_hits=%lu label_misses=%lu interval_ms=%llu churn_pct=%d\n",
+			fs->xrequests, fs->rows, fs->rows * MAXHIST, fs->heap, fs->allocs,
+			fs->ttff / 1000, fs->label_hits, fs->label_misses,
+			st->interval / 1000000, st->churn);
+	fflush(fs->dump);
+}
 
-	st = (struct state*) closure;
-	pth = *(struct proc_t_history **)what;
+/* Once -alloc-check frames have gone by, a frame that touches the heap
+   fails the run; -stats-frames ends one that got that far. */
+static void stats_check_frame(struct state *st) {
+	struct frame_stats *fs = &st->stats;
 
-	switch (which) {
-		case preorder: return;
-		case endorder: return;
-		case postorder:
-		case leaf: ;
+	fs->allocs = allocs_count - fs->alloc_start;
+	if (fs->alloc_check && st->frames > fs->alloc_check && fs->allocs) {
+		fprintf(stderr, "%s: FAIL: frame %d made %lu heap allocations\n",
+				progname, st->frames, fs->allocs);
+		exit(1);
 	}
+	if (fs->max_frames && st->frames >= fs->max_frames) {
+		if (fs->alloc_check)
+			fprintf(stderr, "%s: no heap allocations in frames %d to %d\n",
+					progname, fs->alloc_check + 1, st->frames);
+		exit(0);
+	}
+}
+
+static void stats_init(struct state *st) {
+	struct frame_stats *fs = &st->stats;
+	static char dumpbuf[BUFSIZ];	/* or stdio mallocs one at the first dump */
+	char *path;
+
+	fs->hud = get_boolean_resource(st->dpy, "stats", "Boolean");
+	fs->interval = get_integer_resource(st->dpy, "statsInterval", "Integer");
+	if (fs->interval < 1) fs->interval = 1;
+	path = get_string_resource(st->dpy, "statsFile", "String");
+	if (path && *path) {
+		if (!strcmp(path, "-")) fs->dump = stderr;
+		else if (!(fs->dump = fopen(path, "a")))
+			fprintf(stderr, "pidgrid: can't open %s: %s\n", path, strerror(errno));
+		else setvbuf(fs->dump, dumpbuf, _IOFBF, sizeof dumpbuf);
+	}
+	if (path) free(path);
+	fs->alloc_check = get_integer_resource(st->dpy, "allocCheck", "Integer");
+	fs->max_frames = get_integer_resource(st->dpy, "statsFrames", "Integer");
+}
+#endif /* PIDGRID_STATS */
+
+#define SEGRECT(r, n, X, Y, W, H) \
+	((r)[n].x = (X), (r)[n].y = (Y), (r)[n].width = (W), (r)[n].height = (H), (n)++)
+
+static int rss_height(unsigned long rss) {
+	if (rss > 100000) return 8;
+	else if (rss > 10000) return 4;
+	else return 1;
+}
+
+/*
+ * The label cache.  Each cell of the atlas holds one row's rendered
+ * label and is only rendered again when the text changes, which the
+ * rounding in label_text keeps rare.  A row keeps its cell until that
+ * is the least recently drawn one and some other row needs a cell.
+ */
+static void label_unlink(struct state *st, int i) {
+	struct label *l = &st->label_cells[i];
+	if (l->newer >= 0) st->label_cells[l->newer].older = l->older;
+	else st->label_newest = l->older;
+	if (l->older >= 0) st->label_cells[l->older].newer = l->newer;
+	else st->label_oldest = l->newer;
+}
+
+static void label_touch(struct state *st, int i) {
+	struct label *l = &st->label_cells[i];
+	if (st->label_newest == i) return;
+	label_unlink(st, i);
+	l->newer = -1;
+	l->older = st->label_newest;
+	st->label_cells[st->label_newest].newer = i;
+	st->label_newest = i;
+}
+
+/* the row is going away; its cell is the first to be reused */
+static void label_release(struct state *st, struct proc_t_history *pth) {
+	int i = pth->label;
+	struct label *l;
+	if (i < 0) return;
+	pth->label = -1;
+	l = &st->label_cells[i];
+	l->owner = NULL;
+	if (st->label_oldest == i) return;
+	label_unlink(st, i);
+	l->older = -1;
+	l->newer = st->label_oldest;
+	st->label_cells[st->label_oldest].older = i;
+	st->label_oldest = i;
+}
+
+/* as many cells as fit in label_cap bytes, in rows no wider than 4096 */
+static Bool label_init(struct state *st) {
+	XGCValues gcv;
+	int bytes = st->xgwa.depth > 16 ? 4 : st->xgwa.depth > 8 ? 2 : 1;
+	int i, rows;
+
+	st->label_w = st->char_width * LABELCHARS;
+	st->label_h = st->line_height;
+	st->label_cols = 4096 / st->label_w;
+	if (st->label_cols < 1) st->label_cols = 1;
+	st->nlabels = st->label_cap / ((unsigned long) st->label_w * st->label_h * bytes);
+	if (st->nlabels > st->label_cols * (32767 / st->label_h))
+		st->nlabels = st->label_cols * (32767 / st->label_h);
+	if (st->nlabels < 1) return False;
+	if (st->nlabels < st->label_cols) st->label_cols = st->nlabels;
+	rows = (st->nlabels + st->label_cols - 1) / st->label_cols;
+
+	if (!(st->label_cells = calloc(st->nlabels, sizeof *st->label_cells))) return False;
+	for (i=0; i<st->nlabels; i++) {
+		st->label_cells[i].newer = i - 1;
+		st->label_cells[i].older = i + 1 < st->nlabels ? i + 1 : -1;
+	}
+	st->label_newest = 0;
+	st->label_oldest = st->nlabels - 1;
+
+	st->label_atlas = XCreatePixmap(st->dpy, st->window, st->label_cols * st->label_w,
+			rows * st->label_h, st->xgwa.depth);
+	st->label_draw = XftDrawCreate(st->dpy, st->label_atlas, st->xgwa.visual,
+			st->xgwa.colormap);
+	gcv.graphics_exposures = False;	/* or every copy sends a NoExpose */
+	st->label_gc = XCreateGC(st->dpy, st->label_atlas, GCGraphicsExposures, &gcv);
+	return True;
+}
+
+/* "pid name key", with sizes rounded to K, M or tenths of G so that a
+   row's text only changes now and then */
+static int label_text(struct state *st, struct proc_t_history *pth, char *text, int size) {
+	char key[24];
+	unsigned long kb;
+	int slot = st->history_index_last, len;
+
+	if (st->mode == M_CPU)
+		sprintf(key, "%d%%", (pth->cpu[slot] + 5) / 10);
+	else if (st->layout == L_OOM)
+		sprintf(key, "oom %d", pth->latest.oom_score);
+	else {
+		kb = pth->rss[slot] * st->page_kb;
+		if (kb < 1024) sprintf(key, "%luK", kb);
+		else if (kb < 1024 * 1024) sprintf(key, "%luM", kb >> 10);
+		else sprintf(key, "%lu.%luG", kb >> 20, ((kb >> 10) & 1023) * 10 >> 10);
+	}
+	len = snprintf(text, size, "%d %s %s", pth->tid, pth->latest.comm, key);
+	return len < size ? len : size - 1;
+}
+
+/* A label at x, y unless it would cover the one above.  From the
+   atlas that's one copy; a cell is rendered only on a miss. */
+static void draw_label(struct state *st, struct proc_t_history *pth, int x, int y) {
+	char text[sizeof st->label_cells->text];
+	struct label *l;
+	XGlyphInfo extents;
+	int len, i, cx, cy;
+
+	if (y < st->label_bottom || !load_font(st)) return;
+	if (st->label_cap && !st->label_atlas && !label_init(st)) st->label_cap = 0;
+	len = label_text(st, pth, text, sizeof text);
+
+	if (!st->label_cap) {
+		XftTextExtentsUtf8(st->dpy, st->font, (FcChar8 *) text, len, &extents);
+		XFillRectangle(st->dpy, st->b, st->bgc, x, y, extents.xOff + 4, st->line_height);
+		XftDrawStringUtf8(st->xftdraw, &st->xft_fg, st->font, x + 2, y + st->font->ascent,
+				(FcChar8 *) text, len);
+		st->label_bottom = y + st->line_height;
+		STATS_ADD(st, label_misses, 1);
+		return;
+	}
+
+	if ((i = pth->label) < 0) {
+		i = st->label_oldest;
+		l = &st->label_cells[i];
+		if (l->owner) l->owner->label = -1;
+		l->owner = pth;
+		l->text[0] = '\0';
+		pth->label = i;
+	}
+	l = &st->label_cells[i];
+	cx = (i % st->label_cols) * st->label_w;
+	cy = (i / st->label_cols) * st->label_h;
+	if (strcmp(l->text, text)) {
+		strcpy(l->text, text);
+		/* cut to fit the cell on a character boundary, rather than
+		   clip, which has Xft allocate a clip list every time */
+		for (;;) {
+			XftTextExtentsUtf8(st->dpy, st->font, (FcChar8 *) text, len, &extents);
+			if (extents.xOff + 4 <= st->label_w || len == 0) break;
+			while (len > 0 && (text[--len] & 0xc0) == 0x80)
+				;
+		}
+		XFillRectangle(st->dpy, st->label_atlas, st->bgc, cx, cy, st->label_w, st->label_h);
+		XftDrawStringUtf8(st->label_draw, &st->xft_fg, st->font, cx + 2, cy + st->font->ascent,
+				(FcChar8 *) text, len);
+		l->width = extents.xOff + 4;
+		STATS_ADD(st, label_misses, 1);
+	} else STATS_ADD(st, label_hits, 1);
+	label_touch(st, i);
+	XCopyArea(st->dpy, st->label_atlas, st->b, st->label_gc, cx, cy,
+			l->width, st->label_h, x, y);
+	st->label_bottom = y + st->label_h;
+}
+
+/* ms between the oldest and newest of the newest n samples */
+static long slot_span(struct state *st, int n) {
+	int oldest = (st->history_index_last - n + 1 + MAXHIST) % MAXHIST;
+	return st->slot_cum_ms[st->history_index_last] - st->slot_cum_ms[oldest];
+}
+
+/* Draw one row, indented by depth.  A nonzero subtree_rss marks a
+   collapsed subtree and sizes the row by the whole subtree. */
+static void draw_row(struct state *st, struct proc_t_history *pth,
+		int depth, unsigned long subtree_rss) {
+	int i, ii, x, y, segw, height, spacing, totheight, margin;
+	int hsize, gap, viscount, room; /* variables  for bar segments */
+	long span, g;
+	int *cur;
+	XRectangle fill[MAXHIST * 2 + 1], outline[MAXHIST];	/* + the collapsed marker */
+	int nfill, noutline;
+	char text[1000] = {'\0'};
+	int textsize;
+
+	spacing = 3;
+	margin = depth * st->indent;
+	pth->visible = false;
 
 	/* skip the "all zero" boring processes */
-	if (pth->processes[st->history_index_last].rss == 0 ) return; 
+	if (pth->latest.rss == 0 ) return; 
 
-	/* figure out height */
-	if (pth->processes[st->history_index_last].rss > 100000) { height = 8; } 
-	else if (pth->processes[st->history_index_last].rss > 10000) { height = 4; } else { height = 1; }
+	height = subtree_rss ? rss_height(subtree_rss) : pth->layout.height;
 	totheight = height * 2 + spacing;
 
 	y = st->currenty - st->pan;
@@ -192,71 +755,36 @@ static void walk_and_draw(const void *what, const VISIT which, void *closure){
 
 	if (y + height > st->xgwa.height) { pth->visible = false; return;} else { pth->visible = true; };
 
+	cur = &st->c_current[pth->layout.palette / 2];
+	XSetForeground(st->dpy,st->fgc,palette_pixel(st, pth->layout.palette, *cur));
+	(*cur)++;
+	if ((*cur)++ >= PALETTESIZE - 1) *cur = 0;
 
-	if (pth->processes[st->history_index_last].uid == 0) {              /*root*/
-		if (pth->processes[st->history_index_last].oom_score < 600)
-		XSetForeground(st->dpy,st->fgc,st->c_root[st->c_root_current].pixel);
-		else
-		XSetForeground(st->dpy,st->fgc,st->c_root_oom[st->c_root_current].pixel);
-		st->c_root_current++; 
-		if (st->c_root_current++ >= 99) st->c_root_current = 0;
-	} else if (pth->processes[st->history_index_last].uid == 65534)  {  /*nobody*/
-		if (pth->processes[st->history_index_last].oom_score < 600)
-		XSetForeground(st->dpy,st->fgc,st->c_nobody[st->c_nobody_current].pixel);
-		else
-		XSetForeground(st->dpy,st->fgc,st->c_nobody_oom[st->c_nobody_current].pixel);
-		st->c_nobody_current++; 
-		if (st->c_nobody_current++ >= 99) st->c_nobody_current = 0;
-	} else if (pth->processes[st->history_index_last].uid < 1000)  {    /*system*/
-		if (pth->processes[st->history_index_last].oom_score < 600)
-		XSetForeground(st->dpy,st->fgc,st->c_system[st->c_system_current].pixel);
-		else
-		XSetForeground(st->dpy,st->fgc,st->c_system_oom[st->c_system_current].pixel);
-		st->c_system_current++;
-		if (st->c_system_current++ >= 99) st->c_system_current = 0;
-	} else  {                                      /*users*/
-		if (pth->processes[st->history_index_last].oom_score < 600)
-		XSetForeground(st->dpy,st->fgc,st->c_users[st->c_user_current].pixel);
-		else
-		XSetForeground(st->dpy,st->fgc,st->c_users_oom[st->c_user_current].pixel);
-		st->c_user_current++;
-		if (st->c_user_current++ >= 99) st->c_user_current = 0;
-	}
-
-	hsize = 0;
-	viscount = 0;
-	for (ii=st->history_index_last; ii > st->history_index_last - MAXHIST; ii--) {
-		i = (MAXHIST + ii) % MAXHIST;
-		/*segw = log10(pth->processes[i].rss); */
-		/*segw = segw * segw;*/
-		segw = pth->processes[i].rss / st->xgwa.width;
-		hsize += segw;
-		viscount++;
-		if (hsize > (st->xgwa.width)) { hsize-=segw; viscount--; break;};
-	}
+	hsize = pth->layout.hsize;
+	viscount = pth->layout.viscount;
 	if (viscount <= 0)  {
 		viscount = 1;
 		hsize = st->xgwa.width - 2;
-		segw = hsize;
 	}
-		/*
-		fprintf(stderr,"viscount: %i pid %i i %i ii %i segw %i hsize %i \n", 
-			viscount, pth->tid, i, ii, segw, hsize);
-			*/
-	gap = (st->xgwa.width - hsize) / viscount;
+	gap = (st->xgwa.width - margin - hsize) / viscount;
 	if (gap < 2) gap = 2;
-
+	/* the space between segments goes by how long each sample took to
+	   come round, so a quiet spell reads wider than a busy one */
+	if (viscount > st->nsamples) viscount = st->nsamples;
+	span = viscount > 1 ? slot_span(st, viscount) : 0;
+	room = st->xgwa.width - margin - hsize - gap;
+
+	nfill = 0;
+	noutline = 0;
+	if (subtree_rss && margin > 4)   /* collapsed marker */
+		SEGRECT(fill, nfill, margin - 4, y + height - 1, 3, 3);
 	x = st->xgwa.width - (gap/2);
 	for (ii=st->history_index_last; ii > st->history_index_last - MAXHIST; ii--) {
 		i = (MAXHIST + ii) % MAXHIST;
 
-		if (x <= 0) { break;}
+		if (x <= margin || !st->sampled_ns[i]) { break;}
 
-		if (0 == pth->processes[i].rss) {
-			segw = 1;
-		} else {
-			segw = pth->processes[i].rss / st->xgwa.width + 1;
-		}
+		segw = pth->layout.segw[i];
 
 		/* Roughly...
 		 R: ▀█▀
@@ -266,45 +794,35 @@ static void walk_and_draw(const void *what, const VISIT which, void *closure){
 		 else: ▄▄▄
 		*/
 
-		if (pth->processes[i].state == 'R') {          /*R = running  */
-			XFillRectangle(st->dpy, st->b, st->fgc, 
-					x - segw, y, 
-					segw    , height) ;
-			XFillRectangle(st->dpy, st->b, st->fgc, 
-					x - segw + (segw / 3) , y + height + (height/2),
-					(segw/3)    , (height/2)) ;
-
-		} else if (pth->processes[i].state == 'D') {   /*D = uninterruptable sleep*/
-			XFillRectangle(st->dpy, st->b, st->fgc, 
-					x - segw + (segw/3), y + (height/2), 
-					(segw/3)    , (height/2)) ;
-			XFillRectangle(st->dpy, st->b, st->fgc, 
-					x - segw, y+ height,
-					segw    , height) ;
-
-		} else if (pth->processes[i].state == 'Z') {           /*Z = zombie*/
-			XFillRectangle(st->dpy, st->b, st->fgc, 
-					x - segw - 1, y - 1, 
-					segw + 1   , height * 2 + 1) ;
-		} else if (pth->processes[i].state == 'T') {           /*T = suspended*/
-			XDrawRectangle(st->dpy, st->b, st->fgc, 
-					x - segw, y , 
-					segw    , height * 2 ) ;
+		if (pth->state[i] == 'R') {          /*R = running  */
+			SEGRECT(fill, nfill, x - segw, y, segw, height);
+			SEGRECT(fill, nfill, x - segw + (segw / 3), y + height + (height/2),
+					(segw/3), (height/2));
+		} else if (pth->state[i] == 'D') {   /*D = uninterruptable sleep*/
+			SEGRECT(fill, nfill, x - segw + (segw/3), y + (height/2),
+					(segw/3), (height/2));
+			SEGRECT(fill, nfill, x - segw, y + height, segw, height);
+		} else if (pth->state[i] == 'Z') {           /*Z = zombie*/
+			SEGRECT(fill, nfill, x - segw - 1, y - 1, segw + 1, height * 2 + 1);
+		} else if (pth->state[i] == 'T') {           /*T = suspended*/
+			SEGRECT(outline, noutline, x - segw, y, segw, height * 2);
 		}
 		else {
-			XFillRectangle(st->dpy, st->b, st->fgc, 
-					x - segw, y + height,  
-					segw    , height) ;
+			SEGRECT(fill, nfill, x - segw, y + height, segw, height);
 		}
 
-		x -= (segw + gap);
+		g = span ? room * (long) st->slot_ms[i] / span : gap;
+		x -= segw + (g < 2 ? 2 : g);
 
 	}
+	if (nfill) XFillRectangles(st->dpy, st->b, st->fgc, fill, nfill);
+	if (noutline) XDrawRectangles(st->dpy, st->b, st->fgc, outline, noutline);
+	if (st->labels) draw_label(st, pth, margin + 2, y);
 
-	if (st->detailpid == pth->tid) {
+	if (st->detailpid == pth->tid && st->detailhost == pth->host) {
 		switch (st->detailstate) {
 			case waiting: 
-				if (time(NULL) > st->showtime) { 
+				if (time(NULL) > st->showtime && load_font(st)) { 
 					st->detailstate = growing;
 				}
 				break;
@@ -319,19 +837,31 @@ static void walk_and_draw(const void *what, const VISIT which, void *closure){
 				break;
 			case showing:
 				st->currenty += st->detailsize;
-				stat2name(pth->tid, name);
-				/*fprintf(stderr,"got name %p %s\n", name, name);*/
 				textsize = sprintf(text, "PID: %i UID: %i RSS: %lu VSIZE: %lu STATE: %c OOMSCORE: %i -- %s", 
 						pth->tid, 
-						pth->processes[st->history_index_last].uid, 
-						pth->processes[st->history_index_last].rss, 
-						pth->processes[st->history_index_last].vsize,
-						pth->processes[st->history_index_last].state,
-						pth->processes[st->history_index_last].oom_score,
-						name
+						pth->latest.uid, 
+						pth->latest.rss, 
+						pth->latest.vsize,
+						pth->latest.state,
+						pth->latest.oom_score,
+						pth->latest.comm
 						);
+				if (st->mode == M_CPU)
+					textsize += sprintf(text + textsize, " (CPU: %i.%i%%)",
+							pth->cpu[st->history_index_last] / 10,
+							pth->cpu[st->history_index_last] % 10);
+				if (MEMMODE(st) && pth->mem_read)
+					textsize += sprintf(text + textsize, " (%s: %lu, %u samples ago)",
+							st->mode == M_PSS ? "PSS" : "USS", pth->mem,
+							pth->age - pth->mem_age);
+				if (subtree_rss)
+					textsize += sprintf(text + textsize, " (subtree RSS: %lu)", subtree_rss);
+				if (pth->host)
+					textsize += sprintf(text + textsize, " @%s",
+							*st->fleet[pth->host - 1].host ? st->fleet[pth->host - 1].host
+							: st->fleet[pth->host - 1].source);
 				XftDrawStringUtf8 (st->xftdraw, &st->xft_fg, st->font,
-						10, y + (height * 2) + st->line_height,
+						10 + margin, y + (height * 2) + st->line_height,
 						(FcChar8 *) &text, textsize);
 				if (time(NULL) > st->showtime) {
 					st->detailstate = shrinking;
@@ -353,6 +883,53 @@ static void walk_and_draw(const void *what, const VISIT which, void *closure){
 
 }
 
+/* With -fleet each host's rows sit under its name, and hosts with no
+   rows (no agent there, say) still get a line saying so. */
+static void draw_host_labels(struct state *st, int upto) {
+	struct pstream_conn *c;
+	char text[200];
+	int y, len;
+
+	while (st->group_host < upto) {
+		c = &st->fleet[st->group_host++];
+		if (!load_font(st)) return;
+		y = st->currenty - st->pan;
+		st->currenty += st->line_height + 2;
+		if (y < 0 || y + st->line_height > st->xgwa.height) continue;
+		len = snprintf(text, sizeof text, "%s%s", *c->host ? c->host : c->source,
+				c->connected ? "" : " (no agent)");
+		XftDrawStringUtf8(st->xftdraw, &st->xft_fg, st->font, 2, y + st->font->ascent,
+				(FcChar8 *) text, len);
+	}
+}
+
+/* total newest RSS of a sibling list and everything under it,
+   which is also hidden for this frame */
+static unsigned long subtree_rss(struct state *st, struct proc_t_history *first) {
+	struct proc_t_history *p;
+	unsigned long rss = 0;
+	for (p = first; p; p = p->next) {
+		p->visible = false;
+		rss += p->latest.rss;
+		rss += subtree_rss(st, p->first_child);
+	}
+	return rss;
+}
+
+static void draw_forest(struct state *st, struct proc_t_history *first, int depth) {
+	struct proc_t_history *p;
+	for (p = first; p; p = p->next) {
+		if (p->host != st->group_host) draw_host_labels(st, p->host);
+		if (st->collapse >= 0 && depth >= st->collapse && p->first_child) {
+			draw_row(st, p, depth, p->latest.rss +
+					subtree_rss(st, p->first_child));
+		} else {
+			draw_row(st, p, depth, 0);
+			draw_forest(st, p->first_child, depth + 1);
+		}
+	}
+}
+
 /*
  * debugging routine
 static void print_proc(struct proc_t *p) {
@@ -363,7 +940,7 @@ static void print_pth(struct proc_t_history *pth){
 	int i;
 	fprintf(stderr,"pth tid %i present %d rss:", pth->tid, pth->present);
 	for (i=0; i<MAXHIST; i++){
-		fprintf(stderr, " %lu", pth->processes[i].rss);
+		fprintf(stderr, " %lu", pth->rss[i]);
 	}
 	fprintf(stderr,"\n");
 }
@@ -372,73 +949,623 @@ static void print_pth(struct proc_t_history *pth){
 static int pid_compare(const void *a, const void *b ) {
 	const struct proc_t_history *pa = a;
 	const struct proc_t_history *pb = b;
+	if (pa->host != pb->host) { return pa->host > pb->host ? 1 : -1;}
 	if (pa->tid > pb->tid) { return 1;}
 	else if (pa->tid < pb->tid) { return -1;}
 	else {return 0;}
 }
 
+static inline unsigned row_bucket(int host, int pid) {
+	return ((unsigned) host * 0x9e3779b1u ^ (unsigned) pid) & (ROWHASH - 1);
+}
+
+static struct proc_t_history *find_row(struct state *st, int host, int pid) {
+	struct proc_t_history *pth;
+	for (pth = st->rowhash[row_bucket(host, pid)]; pth; pth = pth->hnext)
+		if (pth->tid == pid && pth->host == host) return pth;
+	return NULL;
+}
+
+/* drawn width of one history sample */
+static int sample_segw(struct state *st, struct proc_t_history *pth, int slot) {
+	if (st->mode == M_CPU) return pth->cpu[slot] / 10 + 1;
+	if (0 == pth->rss[slot]) return 1;
+	return pth->rss[slot] / st->xgwa.width + 1;
+}
+
+/* CPU used since the row's previous sample, as permille of one CPU.
+ * Scaled by the time that really passed between the two scans, so a
+ * late frame doesn't read as a busy process.
+ */
+static void cpu_push(struct state *st, struct proc_t_history *pth, int slot) {
+	unsigned long long ticks, dt, permille;
+
+	ticks = pth->latest.utime + pth->latest.stime;
+	pth->cpu[slot] = 0;
+	if (pth->age > 0 && ticks >= pth->ticks &&
+			(dt = st->sampled_ns[slot] - pth->ticks_ns) > 0) {
+		permille = (ticks - pth->ticks) * 1000 * (1000000000ULL / st->hz) / dt;
+		pth->cpu[slot] = permille > 0xffff ? 0xffff : permille;
+	}
+	pth->ticks = ticks;
+	pth->ticks_ns = st->sampled_ns[slot];
+}
+
+static void layout_reset(struct row_layout *l) {
+	int i;
+	for (i=0; i<MAXHIST; i++) l->segw[i] = 1;
+	l->hsize = 0;
+	l->viscount = MAXHIST;
+}
+
+/* Account for a new sample landing in the given slot, which held the
+ * oldest one.  The window is the run of newest samples whose widths
+ * (less the one pixel minimum) fit across the screen, so it only ever
+ * loses slots at its old end.
+ */
+static void layout_push(struct state *st, struct proc_t_history *pth, int slot) {
+	struct row_layout *l = &pth->layout;
+	const proc_t *p = &pth->latest;
+	int oldest;
+
+	if (l->viscount == MAXHIST) {
+		l->hsize -= l->segw[slot] - 1;
+		l->viscount--;
+	}
+	l->segw[slot] = sample_segw(st, pth, slot);
+	l->hsize += l->segw[slot] - 1;
+	l->viscount++;
+	while (l->viscount > 0 && l->hsize > st->xgwa.width) {
+		oldest = (slot - l->viscount + 1 + MAXHIST) % MAXHIST;
+		l->hsize -= l->segw[oldest] - 1;
+		l->viscount--;
+	}
+
+	l->height = rss_height(pth->rss[slot]);
+
+	if (p->uid == 0) { l->palette = C_ROOT * 2; }
+	else if (p->uid == NOBODY) { l->palette = C_NOBODY * 2; }
+	else if (p->uid < USERS) { l->palette = C_SYSTEM * 2; }
+	else { l->palette = C_USERS * 2; }
+	if (p->oom_score >= 600) l->palette++;
+}
+
+/* replay the whole ring, oldest first */
+static void layout_rebuild(struct state *st, struct proc_t_history *pth) {
+	int i;
+	layout_reset(&pth->layout);
+	for (i=1; i<=MAXHIST; i++)
+		layout_push(st, pth, (st->history_index_last + i) % MAXHIST);
+}
+
+static long sort_key(struct state *st, struct proc_t_history *pth, int slot) {
+	int then;
+
+	switch (st->layout) {
+		case L_RSS: return pth->rss[slot];
+		case L_OOM: return pth->latest.oom_score;
+		case L_GROWTH:
+			/* pages per second over the last few samples */
+			if (pth->age < GROWTHSPAN) return 0;
+			then = (slot + MAXHIST - GROWTHSPAN) % MAXHIST;
+			return ((double) pth->rss[slot] - (double) pth->rss[then]) * 1e9 /
+				(double) (st->sampled_ns[slot] - st->sampled_ns[then]);
+		default: return 0;
+	}
+}
+
+static int order_before(const struct proc_t_history *a,
+		const struct proc_t_history *b) {
+	if (a->sortkey != b->sortkey) return a->sortkey > b->sortkey;
+	return pid_compare(a, b) < 0;
+}
+
+/* heapsort, since glibc's qsort mallocs */
+static void order_sift_down(struct proc_t_history **a, int i, int n) {
+	struct proc_t_history *t;
+	int c;
+	for (; (c = 2 * i + 1) < n; i = c) {
+		if (c + 1 < n && order_before(a[c], a[c + 1])) c++;
+		if (!order_before(a[i], a[c])) break;
+		t = a[i]; a[i] = a[c]; a[c] = t;
+	}
+}
+
+static void order_sort(struct proc_t_history **a, int n) {
+	struct proc_t_history *t;
+	int i;
+	for (i=n/2-1; i>=0; i--) order_sift_down(a, i, n);
+	for (i=n-1; i>0; i--) {
+		t = a[0]; a[0] = a[i]; a[i] = t;
+		order_sift_down(a, 0, i);
+	}
+}
+
+/* Put st->order right again for the sorted layouts.  Gone rows left
+ * holes, new rows were tacked on the end, and some keys moved.  Rows
+ * whose keys held still are still in order among themselves, so only
+ * the rest are pulled out and sorted, then merged back in from the
+ * end.  When every key moves, as in growth mode, that is one sort.
+ */
+static void order_update(struct state *st) {
+	struct proc_t_history **moved = st->resorted, *p;
+	int i, n, m;
+
+	for (i=n=m=0; i<st->norder; i++) {
+		if (!(p = st->order[i])) continue;
+		if (p->resort) moved[m++] = p;
+		else st->order[n++] = p;
+		p->resort = false;
+	}
+	order_sort(moved, m);
+	st->norder = i = n + m;
+	while (m > 0) {
+		if (n > 0 && order_before(moved[m - 1], st->order[n - 1]))
+			st->order[--i] = st->order[--n];
+		else st->order[--i] = moved[--m];
+	}
+	for (i=0; i<st->norder; i++) st->order[i]->rank = i;
+}
+
+/* Between readings, RSS scaled by how PSS/USS compared to it last
+   time; rows that haven't been read yet just show RSS. */
+static unsigned long mem_estimate(struct proc_t_history *pth) {
+	if (!pth->mem_read || !pth->mem_rss) return pth->latest.rss;
+	return (unsigned long long) pth->latest.rss * pth->mem / pth->mem_rss;
+}
+
+/* Who gets a smaps_rollup read next: rows never read first, then by
+ * samples since the last reading, weighted up for rows on screen and
+ * rows whose RSS has since moved.  Staleness keeps growing, so
+ * everyone comes round eventually. */
+static long mem_priority(struct proc_t_history *pth) {
+	long stale, drift;
+
+	if (!pth->mem_read) return pth->visible ? LONG_MAX : LONG_MAX - 1;
+	stale = pth->age - pth->mem_age + 1;
+	/* in eighths of the RSS at the last reading */
+	drift = labs((long) pth->latest.rss - (long) pth->mem_rss) * 8 / (pth->mem_rss + 1);
+	if (drift > 8) drift = 8;
+	return stale * (pth->visible ? 4 : 1) * (1 + drift);
+}
+
+static int mem_before(const struct mem_candidate *a, const struct mem_candidate *b) {
+	if (a->priority != b->priority) return a->priority > b->priority;
+	return a->pth->tid < b->pth->tid;
+}
+
+/* st->memq is a heap with the most deserving row on top */
+static void mem_sift_down(struct state *st, int i) {
+	struct mem_candidate *q = st->memq, t;
+	int c;
+	for (; (c = 2 * i + 1) < st->nmemq; i = c) {
+		if (c + 1 < st->nmemq && mem_before(&q[c + 1], &q[c])) c++;
+		if (!mem_before(&q[c], &q[i])) break;
+		t = q[i]; q[i] = q[c]; q[c] = t;
+	}
+}
+
+/* Read smaps_rollup for the most deserving rows until this sample's
+   budget is spent; always at least one, so the rotation moves.  The
+   budget only lets a few through, so they come off a heap rather than
+   out of a full sort. */
+static void mem_sample(struct state *st) {
+	unsigned long long start = now_ns();
+	struct proc_t_history *pth;
+	unsigned long pss, uss;
+	int i;
+
+	st->nmemq = 0;
+	for (i=0; i<st->nlive; i++) {
+		pth = st->live[i];
+		/* kernel threads have neither RSS nor a rollup */
+		if (!pth->present || pth->mem_failed || pth->latest.rss == 0) continue;
+		st->memq[st->nmemq].priority = mem_priority(pth);
+		st->memq[st->nmemq++].pth = pth;
+	}
+	for (i = st->nmemq / 2 - 1; i >= 0; i--) mem_sift_down(st, i);
+	for (i=0; st->nmemq; i++) {
+		if (i > 0 && now_ns() - start >= st->mem_budget) break;
+		pth = st->memq[0].pth;
+		st->memq[0] = st->memq[--st->nmemq];
+		mem_sift_down(st, 0);
+		if (simple_readproc_rollup(pth->tid, &pss, &uss) < 0) {
+			pth->mem_failed = true;
+			continue;
+		}
+		pth->mem = st->mode == M_PSS ? pss : uss;
+		pth->mem_rss = pth->latest.rss;
+		pth->mem_age = pth->age;
+		pth->mem_read = true;
+	}
+}
+
+static int no_detail(int pid, void *closure) {
+	return 0;
+}
+
+/* rows below the top ones keep their last oom score rather than
+   costing two more file reads per scan */
+static int want_detail(int pid, void *closure) {
+	struct state *st = (struct state *) closure;
+	struct proc_t_history *pth = find_row(st, 0, pid);
+	return !pth || pth->rank < 0 || pth->rank < st->top;
+}
+
+static void push_row(struct state *st, struct proc_t_history *pth) {
+	long key;
+	pth->present = false;
+	pth->visible = false;
+	pth->rss[st->history_index] = MEMMODE(st) ? mem_estimate(pth) : pth->latest.rss;
+	pth->state[st->history_index] = pth->latest.state;
+	if (pth->cpu) cpu_push(st, pth, st->history_index);
+	layout_push(st, pth, st->history_index);
+	if (SORTED(st)) {
+		key = sort_key(st, pth, st->history_index);
+		if (key != pth->sortkey) pth->resort = true;
+		pth->sortkey = key;
+	}
+	pth->age++;
+}
+
+/*
+ * The process forest.  Rows are linked under their parent's row, or
+ * into the root list when the parent isn't known, with siblings kept
+ * in pid order.  Only rows that are new or whose ppid changed get
+ * relinked on a scan, and rows that exit hand their children to the
+ * root list until the next scan shows where the kernel put them.
+ */
+static void forest_unlink(struct state *st, struct proc_t_history *pth) {
+	struct proc_t_history **first, **last;
+	if (!pth->linked) return;
+	if (pth->parent) {
+		first = &pth->parent->first_child;
+		last = &pth->parent->last_child;
+	} else {
+		first = &st->first_root;
+		last = &st->last_root;
+	}
+	if (pth->prev) pth->prev->next = pth->next; else *first = pth->next;
+	if (pth->next) pth->next->prev = pth->prev; else *last = pth->prev;
+	pth->parent = pth->prev = pth->next = NULL;
+	pth->linked = false;
+}
+
+static void forest_link(struct state *st, struct proc_t_history *pth,
+		struct proc_t_history *parent) {
+	struct proc_t_history **first, **last, *after, *a;
+
+	/* a stale ppid must not make a loop */
+	for (a = parent; a; a = a->parent)
+		if (a == pth) { parent = NULL; break; }
+
+	if (parent) {
+		first = &parent->first_child;
+		last = &parent->last_child;
+	} else {
+		first = &st->first_root;
+		last = &st->last_root;
+	}
+	/* new pids are usually the biggest, so look from the end */
+	for (after = *last; after && pid_compare(after, pth) > 0; after = after->prev)
+		;
+	pth->parent = parent;
+	pth->prev = after;
+	pth->next = after ? after->next : *first;
+	if (pth->next) pth->next->prev = pth; else *last = pth;
+	if (after) after->next = pth; else *first = pth;
+	pth->linked = true;
+}
+
+static void forest_relink(struct state *st, struct proc_t_history *pth) {
+	forest_unlink(st, pth);
+	pth->ppid = pth->latest.ppid;
+	forest_link(st, pth, pth->ppid ? find_row(st, pth->host, pth->ppid) : NULL);
+}
+
+/* Rows in the root list with a ppid are waiting on a parent that
+   wasn't in an earlier scan, filtered out or not yet seen; once it
+   has a row they go under it. */
+static void forest_adopt(struct state *st) {
+	struct proc_t_history *pth, *next, *parent;
+	for (pth = st->first_root; pth; pth = next) {
+		next = pth->next;
+		if (pth->ppid && (parent = find_row(st, pth->host, pth->ppid))) {
+			forest_unlink(st, pth);
+			forest_link(st, pth, parent);
+		}
+	}
+}
+
+static void forest_remove(struct state *st, struct proc_t_history *pth) {
+	struct proc_t_history *c;
+	while ((c = pth->first_child)) {
+		forest_unlink(st, c);
+		forest_link(st, c, NULL);
+	}
+	forest_unlink(st, pth);
+}
+
+/* A fresh row, hashed and in its place in st->live.  New pids are
+   usually the biggest so far, so the place is looked for from the end. */
+static struct proc_t_history *row_new(struct state *st, int host, int pid) {
+	struct proc_t_history *pth, **bucket;
+	struct row_slab *slab;
+	unsigned short *cpu;
+	int i, wantcpu = (st->fields & PF_CPU) != 0;
+
+	if (st->nlive == MAXROWS) return NULL;
+	if (!st->freerows) {
+		if (!(slab = malloc(sizeof *slab + wantcpu * ROWSLAB * sizeof *slab->cpu)))
+			return NULL;
+		slab->next = st->slabs;
+		st->slabs = slab;
+		for (i=0; i<ROWSLAB; i++) {
+			slab->rows[i].cpu = wantcpu ? slab->cpu[i] : NULL;
+			slab->rows[i].hnext = st->freerows;
+			st->freerows = &slab->rows[i];
+		}
+	}
+	pth = st->freerows;
+	st->freerows = pth->hnext;
+	cpu = pth->cpu;
+	memset(pth, 0, sizeof *pth);
+	if ((pth->cpu = cpu)) memset(cpu, 0, MAXHIST * sizeof *cpu);
+	pth->host = host;
+	pth->tid = pid;
+	pth->label = -1;
+	pth->rank = -1;
+	layout_reset(&pth->layout);
+
+	bucket = &st->rowhash[row_bucket(host, pid)];
+	pth->hnext = *bucket;
+	*bucket = pth;
+
+	for (i = st->nlive; i > 0 && pid_compare(st->live[i - 1], pth) > 0; i--)
+		st->live[i] = st->live[i - 1];
+	st->live[i] = pth;
+	st->nlive++;
+	return pth;
+}
+
+/* back to the free list; the caller has already taken it out of st->live */
+static void row_free(struct state *st, struct proc_t_history *pth) {
+	struct proc_t_history **p = &st->rowhash[row_bucket(pth->host, pth->tid)];
+	while (*p != pth) p = &(*p)->hnext;
+	*p = pth->hnext;
+	pth->hnext = st->freerows;
+	st->freerows = pth;
+}
+
+/* The slot about to be filled gets its time, and how long it has been
+   since the last one, capped so a suspend doesn't flatten the rest. */
+static void slot_stamp(struct state *st, unsigned long long now) {
+	int slot = st->history_index;
+	unsigned long long ms = st->nsamples
+		? (now - st->sampled_ns[st->history_index_last]) / 1000000
+		: st->interval / 1000000;
+	if (ms > st->sample_max / 250000) ms = st->sample_max / 250000;
+	if (ms < 1) ms = 1;
+	st->sampled_ns[slot] = now;
+	st->slot_ms[slot] = ms;
+	st->cum_ms += ms;
+	st->slot_cum_ms[slot] = st->cum_ms;
+	if (st->nsamples < MAXHIST) st->nsamples++;
+}
+
+/* Churn steers the cadence.  A busy table halves the interval, down
+ * to -sample-min, and a quiet one stretches it by a quarter, up to
+ * -sample-max; a burst of new or exited pids goes straight to the
+ * fastest rate. */
+static void cadence_update(struct state *st) {
+	int rows = st->nlive + st->ngone;
+	if (rows == 0) rows = 1;
+	st->churn = (st->spawned + st->ngone + st->changed) * 100 / rows;
+	if ((st->spawned + st->ngone) * 100 / rows >= CHURN_FAST) st->interval = 0;
+	else if (st->churn >= CHURN_FAST) st->interval /= 2;
+	else if (st->churn < CHURN_SLOW) st->interval += st->interval / 4;
+	if (st->interval < st->sample_min) st->interval = st->sample_min;
+	if (st->interval > st->sample_max) st->interval = st->sample_max;
+}
+
+static void
+merge_procs(struct state *st, int host, proc_t *processes, int numprocs) {
+	int i;
+	struct proc_t_history *pth;
+
+	for(i=0; i<numprocs; i++){
+		if (processes[i].tid == 0) { continue;};
+
+		if (!(pth = find_row(st, host, processes[i].tid))) {
+			if (!(pth = row_new(st, host, processes[i].tid))) continue;
+			pth->latest = processes[i];
+			pth->present = true;
+			st->spawned++;
+			STATS_ADD(st, rows, 1);
+			if (st->nrelink < MAXROWS) st->relink[st->nrelink++] = pth;
+			if (SORTED(st) && st->norder < MAXROWS * 2) {
+				pth->rank = st->norder;
+				pth->resort = true;
+				st->order[st->norder++] = pth;
+			}
+		} else {
+			/* agents' tables are the base for their next deltas;
+			   leave them be */
+			if (host == 0 && processes[i].oom_score < 0) {
+				processes[i].oom_score = pth->latest.oom_score;
+				processes[i].oom_adj = pth->latest.oom_adj;
+			}
+			/* agents don't send the hash; their rows are compared whole */
+			if (host ? memcmp(&pth->latest, &processes[i], sizeof processes[i])
+					: pth->latest.stat_hash != processes[i].stat_hash)
+				st->changed++;
+			pth->latest = processes[i];
+			pth->present = true;
+			if (pth->ppid != processes[i].ppid && st->nrelink < MAXROWS)
+				st->relink[st->nrelink++] = pth;
+		}
+
+	}
+}
+
+/* double the scan buffer, up to as many rows as can be kept */
+static int scan_grow(struct state *st) {
+	int cap = st->scancap ? st->scancap * 2 : SCANPROCS;
+	proc_t *grown;
+	if (st->scancap >= MAXROWS) return 0;
+	if (cap > MAXROWS) cap = MAXROWS;
+	if (!(grown = realloc(st->scan, cap * sizeof *grown))) return 0;
+	st->scan = grown;
+	st->scancap = cap;
+	return 1;
+}
 
 static void
 update_proctree(struct state *st) {
 
 	int numprocs, i, j;
-	struct proc_t_history **entry, *proto;
-	proc_t processes[MAXPROCS];
-	struct proc_t emptyproc;
-
-	emptyproc.tid=0;
-	emptyproc.ppid=0;
-	emptyproc.uid=0;
-	emptyproc.oom_score=0;
-	emptyproc.oom_adj=0;
-	emptyproc.rtprio=0;
-	emptyproc.sched=0;
-	emptyproc.tty=0;
-	emptyproc.state='S';
-	emptyproc.vsize=0;
-	emptyproc.rss=0;
-
-	numprocs = get_all_procs(processes, MAXPROCS);
+	struct proc_t_history *pth;
 
-	for(i=0; i<numprocs; i++){
-		proto = calloc(1, sizeof *proto);
-		proto->tid = processes[i].tid;
-		if (proto->tid == 0) { continue;};
-		proto->present = true;
+	STATS_MARK(st);
+	STATS_ADD(st, samples, 1);
+	slot_stamp(st, now_ns());
+	st->nrelink = 0;
+	st->spawned = st->changed = 0;
+	if (st->nfleet) {
+		/* each agent's table as of the last frame it sent */
+		for (i=0; i<st->nfleet; i++) {
+			pstream_conn_poll(&st->fleet[i]);
+			merge_procs(st, i + 1, st->fleet[i].table.procs, st->fleet[i].table.n);
+		}
+		STATS_LAP(st, T_SCAN);
+	} else if (st->scancap || scan_grow(st)) {
+		/* a full buffer may have left pids out: grow it and look again */
+		while ((numprocs = get_all_procs_detail(st->scan, st->scancap, st->fields,
+				!st->frames ? no_detail :
+				(SORTED(st) && st->top > 0 && st->layout != L_OOM) ? want_detail : NULL,
+				st)) == st->scancap && scan_grow(st))
+			;
+		STATS_LAP(st, T_SCAN);
+		merge_procs(st, 0, st->scan, numprocs);
+	}
 
-		entry = tfind(proto, &st->pidtree, pid_compare);
+	if (MEMMODE(st) && st->frames) {
+		STATS_LAP(st, T_HIST);
+		mem_sample(st);
+		STATS_LAP(st, T_MEM);
+	}
 
-		if (!entry) {
-			for (j=0; j<MAXHIST; j++) { proto->processes[j] = emptyproc;}
-			proto->processes[st->history_index] = processes[i];
-			entry = tsearch(proto, &st->pidtree, pid_compare);
-		} else {
-			(*entry)->processes[st->history_index] = processes[i];
-			free(proto);
+	/* every row moves on a slot, and rows whose pid didn't show up go */
+	st->ngone = 0;
+	for (i=j=0; i<st->nlive; i++) {
+		pth = st->live[i];
+		if (!pth->present) {
+			st->gone[st->ngone++] = pth;
+			continue;
 		}
-
+		push_row(st, pth);
+		st->live[j++] = pth;
 	}
+	st->nlive = j;
 
 	st->history_index_last = st->history_index;
+
+	for (i=0; i<st->ngone; i++) {
+		if (st->gone[i]->rank >= 0) st->order[st->gone[i]->rank] = NULL;
+		forest_remove(st, st->gone[i]);
+		label_release(st, st->gone[i]);
+		row_free(st, st->gone[i]);
+		STATS_ADD(st, rows, -1);
+	}
+	for (i=0; i<st->nrelink; i++) forest_relink(st, st->relink[i]);
+	if (st->spawned && st->layout == L_TREE) forest_adopt(st);
+	if (SORTED(st)) order_update(st);
+
 	st->history_index++;
 	if (st->history_index == MAXHIST) { st->history_index = 0;} 
+	cadence_update(st);
+	STATS_LAP(st, T_HIST);
 }
 
 	static void *
 pidgrid_init (Display *dpy, Window window)
 {
-	int colorcount, hue;
-	char *fontname, *colorname;
+	int i;
+	char *colorname;
+	static const char *hue_resources[NCLASSES] =
+		{ "usersHue", "rootHue", "systemHue", "nobodyHue" };
 
 	struct state *st;
 	XGCValues gcv;
 
 	st = (struct state *) calloc (1, sizeof(*st));
+	st->init_ns = now_ns();
 
 	st->dpy = dpy;
 	st->window = window;
 
 	st->delay = get_integer_resource (st->dpy, "delay", "Integer");
+	st->sample_min = get_float_resource (st->dpy, "sampleMin", "Float") * 1e9;
+	st->sample_max = get_float_resource (st->dpy, "sampleMax", "Float") * 1e9;
+	if (st->sample_max < st->sample_min) st->sample_max = st->sample_min;
+	st->interval = st->sample_min;
+	st->hz = sysconf(_SC_CLK_TCK);
+	if (st->hz <= 0) st->hz = 100;
+	{
+		char *mode = get_string_resource (st->dpy, "mode", "Mode");
+		if (mode && !strcmp(mode, "cpu")) st->mode = M_CPU;
+		else if (mode && !strcmp(mode, "pss")) st->mode = M_PSS;
+		else if (mode && !strcmp(mode, "uss")) st->mode = M_USS;
+		else st->mode = M_RSS;
+		if (mode) free (mode);
+		mode = get_string_resource (st->dpy, "layout", "Layout");
+		if (!mode) st->layout = L_PID;
+		else if (!strcmp(mode, "tree")) st->layout = L_TREE;
+		else if (!strcmp(mode, "rss")) st->layout = L_RSS;
+		else if (!strcmp(mode, "oom")) st->layout = L_OOM;
+		else if (!strcmp(mode, "growth")) st->layout = L_GROWTH;
+		else st->layout = L_PID;
+		if (mode) free (mode);
+	}
+	st->collapse = get_integer_resource (st->dpy, "collapseDepth", "Integer");
+	st->indent = get_integer_resource (st->dpy, "indent", "Integer");
+	st->top = get_integer_resource (st->dpy, "top", "Integer");
+	st->mem_budget = get_integer_resource (st->dpy, "memBudget", "Integer") * 1000ULL;
+	st->labels = get_boolean_resource (st->dpy, "labels", "Boolean");
+	st->label_cap = get_integer_resource (st->dpy, "labelCache", "Integer") * 1024UL;
+	st->page_kb = sysconf(_SC_PAGESIZE) / 1024;
+	if (st->page_kb <= 0) st->page_kb = 4;
+	st->fields = PF_BASIC | PF_COMM;
+	if (st->mode == M_CPU) st->fields |= PF_CPU;
+	if (st->layout == L_TREE) st->fields |= PF_PPID;
+	if (st->layout != L_TREE) st->indent = 0;
+	st->want_uring = get_boolean_resource (st->dpy, "uring", "Boolean");
+	{
+		char *filter = get_string_resource (st->dpy, "filter", "Filter");
+		if (filter && procs_set_filter (filter) < 0) {
+			fprintf (stderr, "%s: bad -filter \"%s\"\n", progname, filter);
+			exit (1);
+		}
+		if (filter) free (filter);
+	}
+	{
+		char *fleet = get_string_resource (st->dpy, "fleet", "Fleet");
+		char *source, *save;
+		if (fleet && *fleet) {
+			st->fleet = calloc (MAXFLEET, sizeof *st->fleet);
+			for (source = strtok_r (fleet, " \t,", &save); source && st->nfleet < MAXFLEET;
+					source = strtok_r (NULL, " \t,", &save))
+				if (pstream_conn_init (&st->fleet[st->nfleet], source) < 0)
+					fprintf (stderr, "%s: can't resolve -fleet \"%s\"; leaving it out\n",
+							progname, source);
+				else st->nfleet++;
+		}
+		if (fleet) free (fleet);
+		if (st->nfleet && MEMMODE(st)) {
+			fprintf (stderr, "%s: -fleet has no PSS/USS; showing RSS\n", progname);
+			st->mode = M_RSS;
+		}
+	}
 	st->dbuf = get_boolean_resource (st->dpy, "doubleBuffer", "Boolean");
 
 	XGetWindowAttributes (dpy, window, &st->xgwa);
@@ -502,15 +1629,10 @@ pidgrid_init (Display *dpy, Window window)
 
 	st->detailstate = newpid;
 	st->detailpid = 1;
+	st->detailhost = 0;
 	st->detailsize = 0;
 	st->showtime = time(NULL) + 5;
 
-    fontname = get_string_resource (st->dpy, "font", "Font");
-	if (!fontname) fontname = strdup("HeavyData Nerd Font 10");
-	st->font = load_xft_font_retry(st->dpy, screen_number (st->xgwa.screen), fontname);
-	if (!st->font) abort();
-	if (fontname) free (fontname);
-
 	colorname = get_string_resource(st->dpy, "foreground","Foreground");
 	if (!colorname) colorname = strdup("white");
 	XftColorAllocName(st->dpy, st->xgwa.visual, st->xgwa.colormap, colorname, &st->xft_fg);
@@ -521,78 +1643,18 @@ pidgrid_init (Display *dpy, Window window)
 	st->xftdraw = XftDrawCreate (dpy, st->b, st->xgwa.visual,
 			st->xgwa.colormap);
 
-   {
-	   XGlyphInfo overall;
-	   XftTextExtentsUtf8 (st->dpy, st->font, (FcChar8 *) "N", 1, &overall);
-	   st->char_width = overall.xOff;
-	   st->line_height = st->font->ascent + st->font->descent + 1;
-   }
-
-	st->c_user_current = 0;
-	st->c_root_current = 0;
-	st->c_system_current = 0;
-	/*users*/
-	colorcount=100;
-	hue = get_integer_resource(st->dpy, "usersHue", "Integer");
-	make_color_loop(st->xgwa.screen, st->xgwa.visual, st->xgwa.colormap,
-			hue, 1, 1.0,
-			hue, 1, 0.5,
-			hue, 1, 0.4,
-			st->c_users, &colorcount, true, false);
-	colorcount=100;
-	make_color_loop(st->xgwa.screen, st->xgwa.visual, st->xgwa.colormap,
-			hue, 0.5, 1.0,
-			hue, 0.5, 0.5,
-			hue, 0.5, 0.4,
-			st->c_users_oom, &colorcount, true, false);
-	/*root*/
-	colorcount=100;
-	hue = get_integer_resource(st->dpy, "rootHue", "Integer");
-	make_color_loop(st->xgwa.screen, st->xgwa.visual, st->xgwa.colormap,
-			hue, 1, 1.0,
-			hue, 1, 0.5,
-			hue, 1, 0.4,
-			st->c_root, &colorcount, true, false);
-	colorcount=100;
-	make_color_loop(st->xgwa.screen, st->xgwa.visual, st->xgwa.colormap,
-			hue, 0.5, 1.0,
-			hue, 0.5, 0.5,
-			hue, 0.5, 0.4,
-			st->c_root_oom, &colorcount, true, false);
-	/*system*/
-	colorcount=100;
-	hue = get_integer_resource(st->dpy, "systemHue", "Integer");
-	make_color_loop(st->xgwa.screen, st->xgwa.visual, st->xgwa.colormap,
-			hue, 1.0, 1.0,
-			hue, 1.0, 0.5,
-			hue, 1.0, 0.4,
-			st->c_system, &colorcount, true, false);
-	colorcount=100;
-	make_color_loop(st->xgwa.screen, st->xgwa.visual, st->xgwa.colormap,
-			hue, 0.5, 1.0,
-			hue, 0.5, 0.5,
-			hue, 0.5, 0.4,
-			st->c_system_oom, &colorcount, true, false);
-	/*nobody*/
-	colorcount=100;
-	hue = get_integer_resource(st->dpy, "nobodyHue", "Integer");
-	make_color_loop(st->xgwa.screen, st->xgwa.visual, st->xgwa.colormap,
-			hue, 1.0, 1.0,
-			hue, 1.0, 0.5,
-			hue, 1.0, 0.4,
-			st->c_nobody, &colorcount, true, false);
-	colorcount=100;
-	make_color_loop(st->xgwa.screen, st->xgwa.visual, st->xgwa.colormap,
-			hue, 0.5, 1.0,
-			hue, 0.5, 0.5,
-			hue, 0.5, 0.4,
-			st->c_nobody_oom, &colorcount, true, false);
+	for (i=0; i<NCLASSES; i++)
+		st->hues[i] = get_integer_resource(st->dpy, (char *) hue_resources[i], "Integer");
 
 	st->lastx = st->xgwa.width;
 	st->currenty = 1;
 
-	st->pidtree = NULL;
-	update_proctree(st);
+#ifdef PIDGRID_STATS
+	stats_init(st);
+#endif
+
+	/* no scan here: the first frame does its own, and skips the
+	   oom files to get something on screen sooner */
 
 	return st;
 }
@@ -601,8 +1663,14 @@ pidgrid_init (Display *dpy, Window window)
 pidgrid_draw (Display *dpy, Window window, void *closure)
 {
 	struct state *st;
+	int i, n;
+	unsigned long long now;
+	unsigned long delay;
 	st = (struct state *) closure;
 
+#ifdef PIDGRID_STATS
+	stats_begin_frame(st);
+#endif
 	XFillRectangle (dpy, st->b, st->bgc, 0, 0, st->xgwa.width, st->xgwa.height);
 
 	/*
@@ -610,14 +1678,32 @@ pidgrid_draw (Display *dpy, Window window, void *closure)
 	   st->currenty = 1;
 	   st->history[st->history_index].numprocs = get_all_procs(&st->history[st->history_index].processes);
 	   */
-	update_proctree(st);
-	st->c_user_current = 0;
-	st->c_root_current = 0;
-	st->c_system_current = 0;
+	/* frames in between samples just redraw */
+	now = now_ns();
+	if (!st->frames || now >= st->next_sample) {
+		update_proctree(st);
+		st->next_sample = now + st->interval;
+	}
+	memset(st->c_current, 0, sizeof st->c_current);
+	st->group_host = 0;
 	st->currenty=0;
+	st->label_bottom=0;
 	st->skipcount=0;
 	st->offbottom=0;
-	twalk_r(st->pidtree,walk_and_draw,st); /* this is where drawing happens */
+	STATS_MARK(st);
+	/* this is where drawing happens */
+	if (st->layout == L_TREE) draw_forest(st, st->first_root, 0);
+	else if (SORTED(st)) {
+		n = st->norder;
+		if (st->top > 0 && st->top < n) n = st->top;
+		for (i=0; i<n; i++) draw_row(st, st->order[i], 0, 0);
+	}
+	else for (i=0; i<st->nlive; i++) {
+		if (st->live[i]->host != st->group_host) draw_host_labels(st, st->live[i]->host);
+		draw_row(st, st->live[i], 0, 0);
+	}
+	if (!SORTED(st)) draw_host_labels(st, st->nfleet);
+	STATS_LAP(st, T_DRAW);
 
 	if (st->offbottom > 0) {
 		if (st->linger > 0) { st->linger--; }
@@ -632,18 +1718,25 @@ pidgrid_draw (Display *dpy, Window window, void *closure)
 
 	if (st->detailstate == newpid ||
 		st->showtime < time(NULL) - 15 ) {
-		st->nodecount = 0;
-		twalk_r(st->pidtree,walk_and_count,st); 
-
-		st->nth = random()%st->nodecount;
-		
-		st->nodecount = 0;
-		twalk_r(st->pidtree,walk_and_choose,st); 
+		/* a visible row, picked at random */
+		for (i=n=0; i<st->nlive; i++) n += st->live[i]->visible;
+		if (n) n = random() % n + 1;
+		for (i=0; n && i<st->nlive; i++)
+			if (st->live[i]->visible && --n == 0) {
+				st->detailpid = st->live[i]->tid;
+				st->detailhost = st->live[i]->host;
+			}
 		st->detailstate = waiting;
 		st->showtime = time(NULL) + 5;
 		
 	}
 
+#ifdef PIDGRID_STATS
+	stats_end_frame(st);
+	stats_draw_hud(st);
+	stats_dump(st);
+#endif
+
 #ifdef HAVE_DOUBLE_BUFFER_EXTENSION
 	if (st->backb)
 	{
@@ -660,8 +1753,25 @@ pidgrid_draw (Display *dpy, Window window, void *closure)
 					st->xgwa.width, st->xgwa.height, 0, 0);
 		}
 
+	if (!st->frames++) {
+#ifdef PIDGRID_STATS
+		XSync (st->dpy, False);
+		st->stats.ttff = now_ns() - st->init_ns;
+#endif
+		/* the ring's setup can wait until there's something to look at */
+		if (st->want_uring && !procs_use_uring(1))
+			fprintf (stderr, "%s: io_uring unavailable, using plain reads\n", progname);
+	}
+#ifdef PIDGRID_STATS
+	stats_check_frame(st);
+#endif
 
-	return 10000 * st->delay;
+	/* wake early if a sample is due before the next frame */
+	delay = 10000 * st->delay;
+	now = now_ns();
+	if (st->next_sample <= now) delay = 0;
+	else if ((st->next_sample - now) / 1000 < delay) delay = (st->next_sample - now) / 1000;
+	return delay;
 }
 
 	static void
@@ -669,8 +1779,10 @@ pidgrid_reshape (Display *dpy, Window window, void *closure,
 		unsigned int w, unsigned int h)
 {
 	struct state *st = (struct state *) closure;
+	int i;
 	st->xgwa.width = w;
 	st->xgwa.height = h;
+	for (i=0; i<st->nlive; i++) layout_rebuild(st, st->live[i]);
 }
 
 	static Bool
@@ -683,9 +1795,31 @@ pidgrid_event (Display *dpy, Window window, void *closure, XEvent *event)
 pidgrid_free (Display *dpy, Window window, void *closure)
 {
 	struct state *st = (struct state *) closure;
+	struct row_slab *slab;
+	int i;
 	XFreeGC (dpy, st->fgc);
 	XFreeGC (dpy, st->bgc);
-	tdestroy(st->pidtree, free);
+	while ((slab = st->slabs)) {
+		st->slabs = slab->next;
+		free(slab);
+	}
+	if (st->label_atlas) {
+		XftDrawDestroy(st->label_draw);
+		XFreePixmap(dpy, st->label_atlas);
+		XFreeGC(dpy, st->label_gc);
+	}
+	free(st->label_cells);
+	free(st->scan);
+	procs_close();
+	for (i=0; i<st->nfleet; i++) {
+		pstream_conn_close(&st->fleet[i]);
+		pstream_table_free(&st->fleet[i].table);
+		free(st->fleet[i].buf);
+	}
+	free(st->fleet);
+#ifdef PIDGRID_STATS
+	if (st->stats.dump && st->stats.dump != stderr) fclose(st->stats.dump);
+#endif
 	free (st);
 }
 
@@ -699,6 +1833,26 @@ static const char *pidgrid_defaults [] = {
 	".nobodyHue:		50",
 	".delay:		    5",
 	".font:		        HeavyData Nerd Font 10",
+	".mode:		        rss",
+	".layout:		    pid",
+	".collapseDepth:	-1",
+	".indent:		    12",
+	".top:		        0",
+	".memBudget:		2000",
+	".sampleMin:		0.02",
+	".sampleMax:		2.0",
+	".uring:		    False",
+	".filter:		",
+	".fleet:		",
+	".labels:		    False",
+	".labelCache:		4096",
+#ifdef PIDGRID_STATS
+	".stats:		    False",
+	".statsFile:		",
+	".statsInterval:	5",
+	".statsFrames:		0",
+	".allocCheck:		0",
+#endif
 #ifdef HAVE_MOBILE
 	"*ignoreRotation:     True",
 #endif
@@ -722,6 +1876,29 @@ static XrmOptionDescRec pidgrid_options [] = {
     { "-system",	".systemHue", XrmoptionSepArg,  0 },
     { "-nobody",	".nobodyHue", XrmoptionSepArg,  0 },
     { "-font",	".font", XrmoptionSepArg,  0 },
+    { "-mode",	".mode", XrmoptionSepArg,  0 },
+    { "-layout",	".layout", XrmoptionSepArg,  0 },
+    { "-collapse",	".collapseDepth", XrmoptionSepArg,  0 },
+    { "-indent",	".indent", XrmoptionSepArg,  0 },
+    { "-top",		".top", XrmoptionSepArg,  0 },
+    { "-mem-budget",	".memBudget", XrmoptionSepArg,  0 },
+    { "-sample-min",	".sampleMin", XrmoptionSepArg,  0 },
+    { "-sample-max",	".sampleMax", XrmoptionSepArg,  0 },
+    { "-uring",		".uring", XrmoptionNoArg,  "True" },
+    { "-filter",	".filter", XrmoptionSepArg,  0 },
+    { "-fleet",		".fleet", XrmoptionSepArg,  0 },
+    { "-no-uring",	".uring", XrmoptionNoArg,  "False" },
+    { "-labels",	".labels", XrmoptionNoArg,  "True" },
+    { "-no-labels",	".labels", XrmoptionNoArg,  "False" },
+    { "-label-cache",	".labelCache", XrmoptionSepArg,  0 },
+#ifdef PIDGRID_STATS
+    { "-stats",		".stats", XrmoptionNoArg,  "True" },
+    { "-no-stats",	".stats", XrmoptionNoArg,  "False" },
+    { "-stats-file",	".statsFile", XrmoptionSepArg,  0 },
+    { "-stats-interval",	".statsInterval", XrmoptionSepArg,  0 },
+    { "-stats-frames",	".statsFrames", XrmoptionSepArg,  0 },
+    { "-alloc-check",	".allocCheck", XrmoptionSepArg,  0 },
+#endif
 	{ 0, 0, 0, 0 }
 };
 
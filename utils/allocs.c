@@ -0,0 +1,58 @@
+/* allocs.c, Copyright (c) 2022 Robbie Huffman <robbie.huffman@nundrum.net>
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation.  No representations are made about the suitability of this
+ * software for any purpose.  It is provided "as is" without express or
+ * implied warranty.
+ *
+ * Counts heap allocations, for the benchmark builds.  malloc and friends
+ * are defined here over glibc's own entry points, so every allocation in
+ * the program bumps allocs_count, libc's and Xlib's included.  #include
+ * it into exactly one file of a program, and not with -fsanitize=address,
+ * which has its own malloc.  Elsewhere than glibc the count stays 0.
+ */
+
+#include <stddef.h>
+#include <errno.h>
+
+static unsigned long allocs_count;
+
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+extern void *__libc_memalign(size_t align, size_t size);
+
+void *malloc(size_t size) {
+	allocs_count++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+	allocs_count++;
+	return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size) {
+	allocs_count++;
+	return __libc_realloc(p, size);
+}
+
+void *memalign(size_t align, size_t size) {
+	allocs_count++;
+	return __libc_memalign(align, size);
+}
+
+void *aligned_alloc(size_t align, size_t size) {
+	return memalign(align, size);
+}
+
+int posix_memalign(void **p, size_t align, size_t size) {
+	if (align % sizeof(void *) || (align & (align - 1))) return EINVAL;
+	if (!(*p = memalign(align, size))) return ENOMEM;
+	return 0;
+}
+#endif /* __GLIBC__ */
@@ -3,8 +3,19 @@
  * https://gitlab.com/procps-ng/procps
  *
  * Reads the Linux system process table from /proc into an array
+ *
+ * Build with -DPROCS_BENCH for a standalone benchmark of the sampler:
+ *   cc -O2 -DPROCS_BENCH -o procs-bench procs.c && ./procs-bench
+ * It exits 1 if sampling still touches the heap after a warm-up sample.
+ *
+ * On Linux with io_uring, procs_use_uring(1) switches the sampler to
+ * batched reads through a ring; it falls back to plain reads by itself
+ * when the kernel (or a seccomp policy) won't play along.
  */
 
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -16,9 +27,38 @@
 #include <dirent.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <fnmatch.h>
+#include <time.h>
+
+#if defined(__linux__) && defined(__has_include)
+# if __has_include(<linux/io_uring.h>)
+#  include <sys/mman.h>
+#  include <sys/resource.h>
+#  include <sys/syscall.h>
+#  include <sys/uio.h>
+#  include <linux/io_uring.h>
+#  ifdef __NR_io_uring_setup
+#   define PROCS_URING
+#  endif
+# endif
+#endif
+
+#ifdef PROCS_BENCH
+# define PIDGRID_STATS
+#endif
 
 #include "procs.h"
 
+#ifdef PIDGRID_STATS
+struct procs_stats procs_stats;
+
+static unsigned long long procs_now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+
 struct utlbuf_s {
 	char *buf;
 	int siz;
@@ -34,53 +74,132 @@ static inline void oomadj2proc(const char *S, proc_t *P)
 	    sscanf(S, "%d", &P->oom_adj);
 }
 
-static int stat2proc (const char *S, proc_t *P) {
+/*
+ * The stat fields we know how to keep, numbered as in proc(5), i.e.
+ * counting "pid (comm)" as fields 1 and 2:
+ * X(field number, PF_ flag that asks for it, how to store it from S)
+ */
+#define STAT_FIELDS(X) \
+	X( 3, PF_STATE, P->state = *S) \
+	X( 4, PF_PPID,  P->ppid = strtol(S, NULL, 10)) \
+	X( 7, PF_TTY,   P->tty = strtol(S, NULL, 10)) \
+	X(14, PF_CPU,   P->utime = strtoull(S, NULL, 10)) \
+	X(15, PF_CPU,   P->stime = strtoull(S, NULL, 10)) \
+	X(23, PF_VSIZE, P->vsize = strtoul(S, NULL, 10)) \
+	X(24, PF_RSS,   P->rss = strtoul(S, NULL, 10)) \
+	X(40, PF_SCHED, P->rtprio = strtol(S, NULL, 10)) \
+	X(41, PF_SCHED, P->sched = strtol(S, NULL, 10))
+
+/* The field sets that get their own parser, smallest first.  The
+   command name is on the way to the rest anyway, so they all keep it. */
+#define STAT_FIELDSETS(X) \
+	X(basic,   PF_BASIC | PF_COMM) \
+	X(cpu,     PF_BASIC | PF_COMM | PF_CPU) \
+	X(tree,    PF_BASIC | PF_COMM | PF_PPID) \
+	X(cputree, PF_BASIC | PF_COMM | PF_CPU | PF_PPID) \
+	X(all,     PF_ALL)
+
+static inline int stat_last_field(const unsigned fields) {
+	int last = 2;
+#define X(n, flag, store) if ((fields & (flag)) && n > last) last = n;
+	STAT_FIELDS(X)
+#undef X
+	return last;
+}
+
+/* Only ever called with a constant field set, so each caller below
+   becomes a parser that stores just its fields and stops reading the
+   line after the last one it needs. */
+static inline __attribute__((always_inline))
+int stat2proc_fields (const char *S, proc_t *P, const unsigned fields) {
+#ifdef PIDGRID_STATS
+	const char *start = S;
+#endif
 	char *tmp;
+	int field;
+	const int last = stat_last_field(fields);
 
 	P->rtprio = -1;
 	P->sched = -1;
 
-	/* printf ("parsing %s\n", S); */
-	sscanf(S, "%d", &P->tid);
+	P->tid = strtol(S, NULL, 10);
 
 	S = strchr(S, '(');
 	if (!S) return 0;
 	S++;
 	tmp = strrchr(S, ')');
 	if (!tmp || !tmp[1]) return 0;
+	if (fields & PF_COMM) {
+		size_t len = tmp - S < sizeof P->comm ? tmp - S : sizeof P->comm - 1;
+		memcpy(P->comm, S, len);
+		P->comm[len] = '\0';
+	}
 	S = tmp +2;
 
+	for (field = 3; ; field++) {
+		switch (field) {
+#define X(n, flag, store) case n: if (fields & (flag)) { store; } break;
+			STAT_FIELDS(X)
+#undef X
+			default: break;
+		}
+		if (field >= last) break;
+		if (!(S = strchr(S, ' '))) break;
+		S++;
+	}
 
-	sscanf(S,
-		   "%c "                      /* state */
-		   "%d %*d %*d %d %*d "       /* ppid, pgrp, sid, tty_nr, tty_pgrp */
-		   "%*u %*u %*u %*u %*u "/* flags, min_flt, cmin_flt, maj_flt, cmaj_flt */
-		   "%*u %*u %*u %*u " /* utime, stime, cutime, cstime */
-		   "%*d %*d "                 /* priority, nice */
-		   "%*d "                     /* num_threads */
-		   "%*u "                    /* 'alarm' == it_real_value (obsolete, always 0) */
-		   "%*u "                   /* start_time */
-		   "%lu "                     /* vsize */
-		   "%lu "                     /* rss */
-		   "%*u %*u %*u %*u %*u %*u " /* rsslim, start_code, end_code, start_stack, esp, eip */
-		   "%*s %*s %*s %*s "         /* pending, blocked, sigign, sigcatch                      <=== DISCARDED */
-		   "%*u %*u %*u "            /* 0 (former wchan), 0, 0                                  <=== Placeholders only */
-		   "%*d %*d "                 /* exit_signal, task_cpu */
-		   "%d %d "                   /* rt_priority, policy (sched) */
-		   "%*u %*u %*u",       /* blkio_ticks, gtime, cgtime */
-		   &P->state,
-		   &P->ppid,
-		   &P->tty,
-		   &P->vsize,
-		   &P->rss,
-		   &P->rtprio,
-		   &P->sched
-		);
-
-	 /* printf ("parsed tid %i uid %i state %c vsize %li\n", P->tid, P->uid, P->state, P->vsize);  */
+#ifdef PIDGRID_STATS
+	procs_stats.parsed += (S ? S : start + strlen(start)) - start;
+#endif
 	return 0;
 }
 
+typedef int (*stat_parser)(const char *S, proc_t *P);
+
+/* Cheap enough to run on every stat line before it's parsed: eight
+   bytes at a time, so a line costs a few dozen multiplies. */
+static unsigned long stat_hash(const char *s, int len) {
+	unsigned long long h = len, w;
+	int i;
+	for (i=0; i + 8 <= len; i += 8) {
+		memcpy(&w, s + i, 8);
+		h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+		h ^= h >> 29;
+	}
+	w = 0;
+	memcpy(&w, s + i, len - i);
+	h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+	return h ^ (h >> 32);
+}
+
+#define X(name, fields) \
+	static int stat2proc_##name (const char *S, proc_t *P) { \
+		return stat2proc_fields(S, P, fields); \
+	}
+STAT_FIELDSETS(X)
+#undef X
+
+/* the smallest specialized parser that covers the fields asked for */
+static stat_parser stat2proc_for(unsigned fields) {
+#define X(name, set) if ((fields & (set)) == fields) return stat2proc_##name;
+	STAT_FIELDSETS(X)
+#undef X
+	return stat2proc_all;
+}
+
+/* where the process table is; a copy of /proc can stand in for it */
+static char proc_root[PROCPATHLEN - 32] = "/proc";
+
+/* The root stays open and is rewound for each scan, which saves
+   opendir's buffer allocation every sample. */
+static DIR *proc_dir;
+
+static DIR *procs_opendir(void) {
+	if (proc_dir) rewinddir(proc_dir);
+	else proc_dir = opendir(proc_root);
+	return proc_dir;
+}
+
 static int file2str(const char *directory, const char *what, struct utlbuf_s *ub) {
 	char path[PROCPATHLEN];
 	int fd,num,tot_read=0,len;
@@ -94,8 +213,10 @@ static int file2str(const char *directory, const char *what, struct utlbuf_s *ub
 
 	len = snprintf(path, sizeof path, "%s/%s", directory, what);
 	if (len <= 0 || (size_t)len >= sizeof path) return -1;
+	PROCS_STAT(syscalls, 1);
 	if (-1 == (fd = open(path, O_RDONLY, 0))) return -1;
-	while (0 < (num = read(fd, ub->buf + tot_read, ub->siz - tot_read))) {
+	while (PROCS_STAT(syscalls, 1),
+		   0 < (num = read(fd, ub->buf + tot_read, ub->siz - tot_read))) {
 		tot_read += num;
 		if (tot_read < ub->siz) break;
 		if (ub->siz >= INT_MAX - buffGRW) {
@@ -111,40 +232,204 @@ static int file2str(const char *directory, const char *what, struct utlbuf_s *ub
 
 	ub->buf[tot_read] = '\0';
 	close(fd);
+	PROCS_STAT(syscalls, 1);
+	PROCS_STAT(bytes, tot_read);
 	if (tot_read < 1) return -1;
 	return tot_read;
 }
 
 
-int simple_readproc(char *path, proc_t *p) {
+/*
+ * The scan filter, set from a spec like
+ *   uid=1000-1999,33 comm=nginx*,php-fpm* rss=2560 state=RD
+ * A process must pass every term given, and passes a term if any of
+ * its comma-separated values match: uids or uid ranges, fnmatch globs
+ * on the command name, a minimum rss in pages, wanted state letters.
+ * Each test runs as soon as the scanner has what it needs, so a uid
+ * that's filtered out costs one fstatat and nothing more.
+ */
+#define FILTERMAX 16
+
+static struct scan_filter {
+	int active;
+	int nuids, ncomms;
+	struct { unsigned lo, hi; } uids[FILTERMAX];
+	char comms[FILTERMAX][64];
+	unsigned long min_rss;
+	char states[32];
+	unsigned fields;	/* PF_ fields the tests read */
+} scan_filter;
+
+int procs_set_filter(const char *spec) {
+	struct scan_filter f;
+	char *copy, *term, *value, *key, *end, *tsave, *vsave;
+	int rc = -1;
+
+	memset(&f, 0, sizeof f);
+	if (!spec || !*spec) {
+		scan_filter = f;
+		return 0;
+	}
+	if (!(copy = strdup(spec))) return -1;
+
+	for (term = strtok_r(copy, " \t", &tsave); term; term = strtok_r(NULL, " \t", &tsave)) {
+		key = term;
+		if (!(value = strchr(term, '='))) goto done;
+		*value++ = '\0';
+		if (!strcmp(key, "uid")) {
+			for (value = strtok_r(value, ",", &vsave); value; value = strtok_r(NULL, ",", &vsave)) {
+				if (f.nuids == FILTERMAX || !isdigit(*value)) goto done;
+				f.uids[f.nuids].lo = f.uids[f.nuids].hi = strtoul(value, &end, 10);
+				if (*end == '-') f.uids[f.nuids].hi = strtoul(end + 1, &end, 10);
+				if (*end) goto done;
+				f.nuids++;
+			}
+		} else if (!strcmp(key, "comm")) {
+			for (value = strtok_r(value, ",", &vsave); value; value = strtok_r(NULL, ",", &vsave)) {
+				if (f.ncomms == FILTERMAX || strlen(value) >= sizeof *f.comms) goto done;
+				strcpy(f.comms[f.ncomms++], value);
+			}
+		} else if (!strcmp(key, "rss")) {
+			f.min_rss = strtoul(value, &end, 10);
+			if (end == value || *end) goto done;
+			f.fields |= PF_RSS;
+		} else if (!strcmp(key, "state")) {
+			if (!*value || strlen(value) >= sizeof f.states) goto done;
+			strcpy(f.states, value);
+			f.fields |= PF_STATE;
+		} else goto done;
+	}
+	f.active = 1;
+	scan_filter = f;
+	rc = 0;
+done:
+	free(copy);
+	return rc;
+}
+
+static int filter_uid(unsigned uid) {
+	int i;
+	if (!scan_filter.nuids) return 1;
+	for (i=0; i<scan_filter.nuids; i++)
+		if (uid >= scan_filter.uids[i].lo && uid <= scan_filter.uids[i].hi) return 1;
+	return 0;
+}
+
+/* the command name is the "(...)" span of a stat line that hasn't
+   been parsed yet */
+static int filter_comm(char *stat_line) {
+	char *open, *close;
+	int i, hit = 0;
+	if (!scan_filter.ncomms) return 1;
+	if (!(open = strchr(stat_line, '(')) || !(close = strrchr(open, ')'))) return 0;
+	*close = '\0';
+	for (i=0; i<scan_filter.ncomms && !hit; i++)
+		hit = !fnmatch(scan_filter.comms[i], open + 1, 0);
+	*close = ')';
+	return hit;
+}
+
+static int filter_parsed(const proc_t *p) {
+	if (p->rss < scan_filter.min_rss) return 0;
+	if (*scan_filter.states && !strchr(scan_filter.states, p->state)) return 0;
+	return 1;
+}
+
+/* Reads /proc/<name>/stat; dfd is an open /proc, or AT_FDCWD.  Returns
+   -1 for anything that isn't a process we can read, or that the scan
+   filter (if passed) turns away. */
+static int readproc_stat_at(int dfd, const char *name, proc_t *p, unsigned fields,
+		const struct scan_filter *filter) {
 	static __thread struct utlbuf_s ub = { NULL, 0 };
 	static __thread struct stat sb;
 
-	int rc, i;
-	char fullpath[PROCPATHLEN];
+	int rc, i, len;
 	char procpath[PROCPATHLEN];
+	stat_parser parse = stat2proc_for(fields);
 
 	rc = 0;
+	memset(p, 0, sizeof *p);
+	p->oom_score = -1;
 
 	/* filter out those non-pid dirs */
-	for (i=0; i<strlen(path); i++) {
-		if (! isdigit(path[i])) return -1;
+	for (i=0; name[i]; i++) {
+		if (! isdigit(name[i])) return -1;
 	}
 
-	snprintf(fullpath, PROCPATHLEN, "/proc/%s/stat", path);
+	snprintf(procpath, PROCPATHLEN, "%s/%s", proc_root, name);
 
-	if (stat(fullpath, &sb) == -1) return -1;
+	/* the directory is owned by the process's uid */
+	PROCS_STAT(syscalls, 1);
+	if (fstatat(dfd, dfd == AT_FDCWD ? procpath : name, &sb, 0) == -1) return -1;
 
 	p->uid = sb.st_uid;
+	if (filter && !filter_uid(p->uid)) goto filtered;
+
+	if ((len = file2str(procpath, "stat", &ub)) == -1) return -1;
+	if (filter && !filter_comm(ub.buf)) goto filtered;
+	p->stat_hash = stat_hash(ub.buf, len);
+#ifdef PIDGRID_STATS
+	{
+		unsigned long long t0 = procs_now_ns();
+		rc += parse(ub.buf, p);
+		procs_stats.parse_ns += procs_now_ns() - t0;
+	}
+	procs_stats.procs++;
+#else
+	rc += parse(ub.buf, p);
+#endif
+	if (filter && !filter_parsed(p)) goto filtered;
+	return rc;
+
+filtered:
+	PROCS_STAT(filtered, 1);
+	return -1;
+}
+
+/* just the PF_ fields asked for from the stat line; the rest are
+   zero, and oom_score is left at -1 for "not read" */
+int simple_readproc_stat(char *path, proc_t *p, unsigned fields) {
+	return readproc_stat_at(AT_FDCWD, path, p, fields, NULL);
+}
 
-	snprintf(procpath, PROCPATHLEN, "/proc/%s", path);
-	if (file2str(procpath, "stat", &ub) == -1) goto next_proc;
-	rc += stat2proc(ub.buf, p);
+void simple_readproc_oom(char *path, proc_t *p) {
+	static __thread struct utlbuf_s ub = { NULL, 0 };
+	char procpath[PROCPATHLEN];
+
+	snprintf(procpath, PROCPATHLEN, "%s/%s", proc_root, path);
 	if (file2str(procpath, "oom_score", &ub) != -1) oomscore2proc(ub.buf, p);
 	if (file2str(procpath, "oom_score_adj", &ub) != -1) oomadj2proc(ub.buf, p);
+}
 
+/* PSS and USS (Private_Clean + Private_Dirty) from smaps_rollup, in
+   pages like rss.  Expensive next to stat: the kernel walks the
+   process's page tables for it.  Fails for other users' processes
+   unless we may ptrace them, and for kernel threads. */
+int simple_readproc_rollup(int pid, unsigned long *pss, unsigned long *uss) {
+	static __thread struct utlbuf_s ub = { NULL, 0 };
+	static long pagekb;
+	char procpath[PROCPATHLEN];
+	unsigned long pss_kb = 0, private_kb = 0;
+	char *s;
+
+	if (!pagekb && (pagekb = sysconf(_SC_PAGESIZE) / 1024) <= 0) pagekb = 4;
+	snprintf(procpath, PROCPATHLEN, "%s/%d", proc_root, pid);
+	if (file2str(procpath, "smaps_rollup", &ub) == -1) return -1;
+
+	for (s = ub.buf; s; s = strchr(s, '\n')) {
+		if (*s == '\n') s++;
+		if (!strncmp(s, "Pss:", 4)) pss_kb = strtoul(s + 4, NULL, 10);
+		else if (!strncmp(s, "Private_Clean:", 14) || !strncmp(s, "Private_Dirty:", 14))
+			private_kb += strtoul(s + 14, NULL, 10);
+	}
+	*pss = pss_kb / pagekb;
+	*uss = private_kb / pagekb;
+	return 0;
+}
 
-next_proc:
+int simple_readproc(char *path, proc_t *p) {
+	int rc = simple_readproc_stat(path, p, PF_ALL);
+	if (rc != -1) simple_readproc_oom(path, p);
 	return rc;
 }
 
@@ -152,27 +437,22 @@ int stat2name (int pid, char *name) {
 	char path[PROCPATHLEN];
 	static __thread struct utlbuf_s ub = { NULL, 0 };
 	int rc;
-	char *tmp;
+	char *open, *close;
 
-	fprintf(stderr,"pid: %i   ", pid);
-	snprintf(path, sizeof path, "/proc/%i", pid);
-	fprintf(stderr,"path: %s   ", path);
+	snprintf(path, sizeof path, "%s/%i", proc_root, pid);
 	rc = file2str(path,"stat",  &ub);
 	if (rc <= 0) return rc;
 
-	ub.buf = strchr(ub.buf, '(');
-	if (!ub.buf) return 0;
-	ub.buf++;
-	tmp = strrchr(ub.buf, ')');
-	if (!tmp || !tmp[1]) return 0;
+	/* ub.buf is ours to keep reusing, so find the name in place */
+	open = strchr(ub.buf, '(');
+	if (!open) return 0;
+	open++;
+	close = strrchr(open, ')');
+	if (!close || !close[1]) return 0;
 
-	fprintf(stderr,"ub.buf %p tmp %p diff %lu ", ub.buf, tmp, (tmp - ub.buf));
-
-	strncpy(name, ub.buf, (tmp - ub.buf));
-	name[tmp - ub.buf + 1] = 0;
-	fprintf(stderr,"name %s\n", name);
-
-	return (tmp - ub.buf);
+	memcpy(name, open, close - open);
+	name[close - open] = '\0';
+	return (close - open);
 }
 
 /*
@@ -195,27 +475,691 @@ out:
 }
 */
 
+#ifdef PROCS_URING
+/*
+ * The io_uring sampler.  Each pid gets a slot that keeps its stat and
+ * oom files open (and, where the kernel allows, registered), plus a
+ * slice of one registered buffer arena to read them into.  A scan
+ * walks /proc for pids, then queues every read for the whole table
+ * and reaps them in bulk, which is a handful of io_uring_enter calls
+ * instead of open/read/close per file per pid.  Owners come from a
+ * queued statx when the kernel has it, else from an fstat each scan.
+ *
+ * Three fds a pid add up, so the table takes no more pids than the
+ * RLIMIT_NOFILE soft limit has room for, less URING_FDSPARE; the rest
+ * take the slow road.  If opens still run out of fds, the scan reads
+ * what it has, closes enough slots to leave a spare's worth of fds and
+ * stays that size, then reads the rest the slow way.
+ */
+#define URING_SLOTS   4096            /* pids followed at once */
+#define URING_HASH    (URING_SLOTS * 2)
+#define URING_STATSZ  1024            /* arena bytes for a stat line */
+#define URING_OOMSZ   32              /* ... and for each oom file */
+#define URING_SLOTSZ  (URING_STATSZ + 2 * URING_OOMSZ)
+#define URING_DEPTH   1024            /* sq entries */
+#define URING_FDSPARE 64              /* fds left over for everyone else */
+
+enum uring_ops { U_STAT, U_OOM, U_OOMADJ, U_STATX, NUOPS };
+#define NUFILES U_STATX               /* ops that read one of our files */
+
+static const char *uring_files[NUFILES] = { "stat", "oom_score", "oom_score_adj" };
+static const int uring_offsets[NUFILES] =
+	{ 0, URING_STATSZ, URING_STATSZ + URING_OOMSZ };
+static const int uring_sizes[NUFILES] = { URING_STATSZ, URING_OOMSZ, URING_OOMSZ };
+
+struct uring_slot {
+	int pid;                  /* 0 when free */
+	int fd[NUFILES];
+	int res[NUOPS];           /* bytes read, or -errno */
+	int seen;                 /* scan it was last listed in */
+	int filtered;             /* turned away last scan; skip its oom files */
+	int oom_later;            /* its oom files wouldn't open; read them plain */
+	unsigned uid;
+	char stat_path[24];       /* "<pid>/stat", for statx */
+	struct statx stx;
+	struct iovec iov[NUFILES];
+};
+
+struct procs_uring {
+	int fd, procfd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned depth, queued;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_len, cq_len, sqes_len;
+	int fixed_files, fixed_bufs, statx;
+	char *arena;
+	int scan;
+	int nslots;               /* slots the fd limit allows */
+	int cap;                  /* slots to fill, lowered when fds run out */
+	int starved;              /* an open hit EMFILE this scan */
+	int nfree;
+	int free[URING_SLOTS];
+	int hash[URING_HASH];     /* slot + 1, open addressing on pid */
+	struct uring_slot slots[URING_SLOTS];
+};
+
+static struct procs_uring *uring;
+static int uring_failed;
+
+static int uring_register(int fd, unsigned op, void *arg, unsigned nr) {
+	return syscall(__NR_io_uring_register, fd, op, arg, nr);
+}
+
+static void uring_free(struct procs_uring *u) {
+	int i, f;
+	for (i=0; i<URING_SLOTS; i++)
+		for (f=0; f<NUFILES; f++)
+			if (u->slots[i].pid && u->slots[i].fd[f] >= 0) close(u->slots[i].fd[f]);
+	if (u->sqes) munmap(u->sqes, u->sqes_len);
+	if (u->cq_ptr && u->cq_ptr != u->sq_ptr) munmap(u->cq_ptr, u->cq_len);
+	if (u->sq_ptr) munmap(u->sq_ptr, u->sq_len);
+	if (u->arena) munmap(u->arena, (size_t) URING_SLOTS * URING_SLOTSZ);
+	if (u->fd >= 0) close(u->fd);
+	if (u->procfd >= 0) close(u->procfd);
+	free(u);
+}
+
+static struct procs_uring *uring_init(void) {
+	struct procs_uring *u;
+	struct io_uring_params params;
+	struct io_uring_probe *probe;
+	struct iovec iov;
+	struct rlimit rl;
+	int *fds, i;
+
+	if (!(u = calloc(1, sizeof *u))) return NULL;
+	u->nslots = URING_SLOTS;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY &&
+			rl.rlim_cur < (rlim_t) URING_SLOTS * NUFILES + URING_FDSPARE)
+		u->nslots = rl.rlim_cur > URING_FDSPARE
+			? (rl.rlim_cur - URING_FDSPARE) / NUFILES : 0;
+	u->cap = u->nslots;
+	u->procfd = -1;
+	memset(&params, 0, sizeof params);
+	/* ENOSYS on old kernels, EPERM when kernel.io_uring_disabled says no */
+	if ((u->fd = syscall(__NR_io_uring_setup, URING_DEPTH, &params)) < 0) {
+		free(u);
+		return NULL;
+	}
+
+	u->depth = params.sq_entries;
+	u->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	u->cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_len > u->sq_len) u->sq_len = u->cq_len;
+		u->cq_len = u->sq_len;
+	}
+	u->sq_ptr = mmap(0, u->sq_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_ptr == MAP_FAILED) { u->sq_ptr = NULL; goto fail; }
+	if (params.features & IORING_FEAT_SINGLE_MMAP) u->cq_ptr = u->sq_ptr;
+	else {
+		u->cq_ptr = mmap(0, u->cq_len, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+		if (u->cq_ptr == MAP_FAILED) { u->cq_ptr = NULL; goto fail; }
+	}
+	u->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(0, u->sqes_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) { u->sqes = NULL; goto fail; }
+
+	u->sq_head = (unsigned *) ((char *) u->sq_ptr + params.sq_off.head);
+	u->sq_tail = (unsigned *) ((char *) u->sq_ptr + params.sq_off.tail);
+	u->sq_mask = (unsigned *) ((char *) u->sq_ptr + params.sq_off.ring_mask);
+	u->sq_array = (unsigned *) ((char *) u->sq_ptr + params.sq_off.array);
+	u->cq_head = (unsigned *) ((char *) u->cq_ptr + params.cq_off.head);
+	u->cq_tail = (unsigned *) ((char *) u->cq_ptr + params.cq_off.tail);
+	u->cq_mask = (unsigned *) ((char *) u->cq_ptr + params.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *) ((char *) u->cq_ptr + params.cq_off.cqes);
+
+	u->arena = mmap(0, (size_t) URING_SLOTS * URING_SLOTSZ, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (u->arena == MAP_FAILED) { u->arena = NULL; goto fail; }
+	if ((u->procfd = open(proc_root, O_RDONLY | O_DIRECTORY)) < 0) goto fail;
+
+	/* The rest are nice to have: without them reads pass plain fds
+	   and iovecs, and owners come from fstat. */
+	iov.iov_base = u->arena;
+	iov.iov_len = (size_t) URING_SLOTS * URING_SLOTSZ;
+	u->fixed_bufs = !uring_register(u->fd, IORING_REGISTER_BUFFERS, &iov, 1);
+
+	if (u->nslots && (fds = malloc(u->nslots * NUFILES * sizeof *fds))) {
+		for (i=0; i<u->nslots * NUFILES; i++) fds[i] = -1;
+		u->fixed_files = !uring_register(u->fd, IORING_REGISTER_FILES,
+				fds, u->nslots * NUFILES);
+		free(fds);
+	}
+
+	if ((probe = calloc(1, sizeof *probe + 256 * sizeof(struct io_uring_probe_op)))) {
+		if (!uring_register(u->fd, IORING_REGISTER_PROBE, probe, 256))
+			u->statx = probe->last_op >= IORING_OP_STATX &&
+				(probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED);
+		free(probe);
+	}
+
+	for (i=0; i<u->nslots; i++) u->free[i] = u->nslots - 1 - i;
+	u->nfree = u->nslots;
+	return u;
+
+fail:
+	uring_free(u);
+	return NULL;
+}
+
+static int uring_hash_find(struct procs_uring *u, int pid) {
+	int h;
+	for (h = pid & (URING_HASH - 1); u->hash[h]; h = (h + 1) & (URING_HASH - 1))
+		if (u->slots[u->hash[h] - 1].pid == pid) return h;
+	return -1;
+}
+
+/* backward-shift delete, so lookups never need tombstones */
+static void uring_hash_delete(struct procs_uring *u, int h) {
+	int j = h, home;
+	for (;;) {
+		u->hash[h] = 0;
+		for (;;) {
+			j = (j + 1) & (URING_HASH - 1);
+			if (!u->hash[j]) return;
+			home = u->slots[u->hash[j] - 1].pid & (URING_HASH - 1);
+			if (h <= j ? (home <= h || home > j) : (home <= h && home > j))
+				break;
+		}
+		u->hash[h] = u->hash[j];
+		h = j;
+	}
+}
+
+static void uring_set_file(struct procs_uring *u, int idx, int f, int fd) {
+	struct io_uring_files_update up;
+	if (!u->fixed_files) return;
+	memset(&up, 0, sizeof up);
+	up.offset = idx * NUFILES + f;
+	up.fds = (unsigned long) &fd;
+	PROCS_STAT(syscalls, 1);
+	uring_register(u->fd, IORING_REGISTER_FILES_UPDATE, &up, 1);
+}
+
+static int uring_open_file(struct procs_uring *u, int idx, int f) {
+	struct uring_slot *s = &u->slots[idx];
+	char path[PROCPATHLEN];
+	snprintf(path, sizeof path, "%d/%s", s->pid, uring_files[f]);
+	PROCS_STAT(syscalls, 1);
+	if ((s->fd[f] = openat(u->procfd, path, O_RDONLY)) < 0) {
+		if (errno == EMFILE || errno == ENFILE) u->starved = 1;
+		return -1;
+	}
+	uring_set_file(u, idx, f, s->fd[f]);
+	return 0;
+}
+
+static void uring_close(struct procs_uring *u, int idx) {
+	struct uring_slot *s = &u->slots[idx];
+	int f, h;
+	for (f=0; f<NUFILES; f++) {
+		if (s->fd[f] < 0) continue;
+		uring_set_file(u, idx, f, -1);
+		PROCS_STAT(syscalls, 1);
+		close(s->fd[f]);
+		s->fd[f] = -1;
+	}
+	if ((h = uring_hash_find(u, s->pid)) >= 0) uring_hash_delete(u, h);
+	s->pid = 0;
+	u->free[u->nfree++] = idx;
+}
+
+/* Without statx the owner comes from fstat on the open stat file,
+   again each scan, since a setuid changes it under the open fd. */
+static void uring_uid_refresh(struct procs_uring *u, struct uring_slot *s) {
+	struct stat sb;
+	if (u->statx) return;
+	PROCS_STAT(syscalls, 1);
+	if (fstat(s->fd[U_STAT], &sb) == 0) s->uid = sb.st_uid;
+}
+
+static int uring_slot_for(struct procs_uring *u, int pid) {
+	struct uring_slot *s;
+	struct stat sb;
+	int h, idx, f;
+
+	if ((h = uring_hash_find(u, pid)) >= 0) {
+		/* uring_admit has looked already when there's a uid filter */
+		if (!scan_filter.nuids) uring_uid_refresh(u, &u->slots[u->hash[h] - 1]);
+		return u->hash[h] - 1;
+	}
+	if (!u->nfree || u->nslots - u->nfree >= u->cap) return -1;
+
+	idx = u->free[--u->nfree];
+	s = &u->slots[idx];
+	s->pid = pid;
+	for (f=0; f<NUFILES; f++) {
+		s->fd[f] = -1;
+		s->iov[f].iov_base = u->arena + (size_t) idx * URING_SLOTSZ + uring_offsets[f];
+		s->iov[f].iov_len = uring_sizes[f] - 1;
+	}
+	snprintf(s->stat_path, sizeof s->stat_path, "%d/stat", pid);
+	for (h = pid & (URING_HASH - 1); u->hash[h]; h = (h + 1) & (URING_HASH - 1))
+		;
+	u->hash[h] = idx + 1;
+
+	if (uring_open_file(u, idx, U_STAT) < 0) { uring_close(u, idx); return -1; }
+	if (!u->statx) {
+		PROCS_STAT(syscalls, 1);
+		if (fstat(s->fd[U_STAT], &sb) < 0) { uring_close(u, idx); return -1; }
+		s->uid = sb.st_uid;
+	}
+	return idx;
+}
+
+/* hand everything queued to the kernel and wait for all of it */
+static int uring_flush(struct procs_uring *u) {
+	unsigned head, tail, n = u->queued;
+	struct io_uring_cqe *cqe;
+	struct uring_slot *s;
+	int rc;
+
+	if (!n) return 0;
+	u->queued = 0;
+	PROCS_STAT(syscalls, 1);
+	rc = syscall(__NR_io_uring_enter, u->fd, n, n, IORING_ENTER_GETEVENTS, NULL, 0);
+	if (rc != (int) n) return -1;
+
+	head = *u->cq_head;
+	tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		cqe = &u->cqes[head & *u->cq_mask];
+		s = &u->slots[cqe->user_data / NUOPS];
+		s->res[cqe->user_data % NUOPS] = cqe->res;
+		if (cqe->res > 0 && cqe->user_data % NUOPS != U_STATX)
+			PROCS_STAT(bytes, cqe->res);
+	}
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static int uring_queue(struct procs_uring *u, int idx, int op) {
+	struct uring_slot *s = &u->slots[idx];
+	struct io_uring_sqe *sqe;
+	unsigned tail;
+
+	if (u->queued == u->depth && uring_flush(u) < 0) return -1;
+	tail = *u->sq_tail;
+	sqe = &u->sqes[tail & *u->sq_mask];
+	memset(sqe, 0, sizeof *sqe);
+	if (op == U_STATX) {
+		sqe->opcode = IORING_OP_STATX;
+		sqe->fd = u->procfd;
+		sqe->addr = (unsigned long) s->stat_path;
+		sqe->len = STATX_UID;
+		sqe->off = (unsigned long) &s->stx;
+	} else {
+		if (u->fixed_bufs) {
+			sqe->opcode = IORING_OP_READ_FIXED;
+			sqe->addr = (unsigned long) s->iov[op].iov_base;
+			sqe->len = s->iov[op].iov_len;
+			sqe->buf_index = 0;
+		} else {
+			sqe->opcode = IORING_OP_READV;
+			sqe->addr = (unsigned long) &s->iov[op];
+			sqe->len = 1;
+		}
+		sqe->off = 0;
+		if (u->fixed_files) {
+			sqe->fd = idx * NUFILES + op;
+			sqe->flags = IOSQE_FIXED_FILE;
+		} else {
+			sqe->fd = s->fd[op];
+		}
+	}
+	sqe->user_data = (unsigned long long) idx * NUOPS + op;
+	s->res[op] = -EAGAIN;
+	u->sq_array[tail & *u->sq_mask] = tail & *u->sq_mask;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	u->queued++;
+	return 0;
+}
+
+/* the uid test, before any of the pid's files are opened */
+static int uring_admit(struct procs_uring *u, const char *name, int pid) {
+	struct stat sb;
+	int h;
+
+	if (!scan_filter.nuids) return 1;
+	if ((h = uring_hash_find(u, pid)) >= 0) {
+		uring_uid_refresh(u, &u->slots[u->hash[h] - 1]);
+		if (filter_uid(u->slots[u->hash[h] - 1].uid)) return 1;
+		uring_close(u, u->hash[h] - 1);
+	} else {
+		PROCS_STAT(syscalls, 1);
+		if (fstatat(u->procfd, name, &sb, 0) == -1) return 0;
+		if (filter_uid(sb.st_uid)) return 1;
+	}
+	PROCS_STAT(filtered, 1);
+	return 0;
+}
+
+/* Plain reads for one pid, into p; 1 if it's a process to keep. */
+static int uring_slow_road(struct procs_uring *u, DIR *procfs, char *name, proc_t *p,
+		unsigned fields, const struct scan_filter *filter,
+		proc_detail_fn detail, void *closure) {
+	errno = 0;
+	if (readproc_stat_at(dirfd(procfs), name, p, fields, filter) == -1) {
+		if (errno == EMFILE || errno == ENFILE) u->starved = 1;
+		return 0;
+	}
+	if (p->tid == 0) return 0;
+	if (!detail || detail(p->tid, closure)) simple_readproc_oom(name, p);
+	return 1;
+}
+
+/* After running out of fds: the fds the table holds now are what it
+   can have, less a spare's worth.  Close slots, the highest first,
+   until it fits, and keep it that size. */
+static void uring_trim(struct procs_uring *u) {
+	int idx, f, held = 0, used = u->nslots - u->nfree;
+	for (idx=0; idx<u->nslots; idx++)
+		if (u->slots[idx].pid)
+			for (f=0; f<NUFILES; f++) held += u->slots[idx].fd[f] >= 0;
+	u->cap = (held - URING_FDSPARE) / NUFILES;
+	if (u->cap < 0) u->cap = 0;
+	for (idx=u->nslots-1; idx>=0 && used > u->cap; idx--)
+		if (u->slots[idx].pid) {
+			uring_close(u, idx);
+			used--;
+		}
+	u->starved = 0;
+}
+
+static int get_all_procs_uring(proc_t p[], int maxprocs, unsigned fields,
+		proc_detail_fn detail, void *closure) {
+	struct procs_uring *u = uring;
+	const struct scan_filter *filter = scan_filter.active ? &scan_filter : NULL;
+	static int listed[URING_SLOTS];
+	static int oom_later[URING_SLOTS];	/* p[] indexes whose oom files wouldn't open */
+	stat_parser parse = stat2proc_for(fields);
+	struct uring_slot *s;
+	DIR *procfs;
+	struct dirent *pdir;
+	int counter, nlisted, noom, i, idx, pid;
+	long pos, resume = -1;
+	char *buf, name[16];
+
+	/* find the pids, opening files for ones we haven't seen */
+	u->scan++;
+	nlisted = noom = 0;
+	counter = 0;
+	if (!(procfs = procs_opendir())) return -1;
+	/* Listed pids may yet be filtered out, so they don't count against
+	   maxprocs; only the slots limit them.  p[] filling up is what
+	   stops the scan, and then it comes back full so the caller can
+	   tell to grow it. */
+	while (counter < maxprocs) {
+		pos = telldir(procfs);
+		if (!(pdir = readdir(procfs))) break;
+		PROCS_STAT(scanned, 1);
+		if (!isdigit(pdir->d_name[0])) continue;
+		pid = atoi(pdir->d_name);
+		if (filter && !uring_admit(u, pdir->d_name, pid)) continue;
+		if ((idx = uring_slot_for(u, pid)) < 0) {
+			/* out of slots; this one takes the slow road */
+			if (!u->starved)
+				counter += uring_slow_road(u, procfs, pdir->d_name, &p[counter],
+						fields, filter, detail, closure);
+			/* out of fds: this pid and the rest wait for some back */
+			if (u->starved) { resume = pos; break; }
+			continue;
+		}
+		u->slots[idx].seen = u->scan;
+		listed[nlisted++] = idx;
+	}
+
+	/* one batch of reads for the lot */
+	for (i=0; i<nlisted; i++) {
+		idx = listed[i];
+		s = &u->slots[idx];
+		s->res[U_OOM] = s->res[U_OOMADJ] = s->res[U_STATX] = -ENODATA;
+		s->oom_later = 0;
+		if (uring_queue(u, idx, U_STAT) < 0) return -1;
+		if (u->statx && uring_queue(u, idx, U_STATX) < 0) return -1;
+		if (s->filtered || (detail && !detail(s->pid, closure))) continue;
+		if (u->starved) { s->oom_later = 1; continue; }
+		if (s->fd[U_OOM] >= 0 || uring_open_file(u, idx, U_OOM) == 0)
+			if (uring_queue(u, idx, U_OOM) < 0) return -1;
+		if (s->fd[U_OOMADJ] >= 0 || uring_open_file(u, idx, U_OOMADJ) == 0)
+			if (uring_queue(u, idx, U_OOMADJ) < 0) return -1;
+		if (u->starved) s->oom_later = 1;
+	}
+	if (uring_flush(u) < 0) return -1;
+
+	for (i=0; i<nlisted && counter < maxprocs; i++) {
+		idx = listed[i];
+		s = &u->slots[idx];
+		/* ESRCH: the pid is gone, or is a new process reusing it,
+		   which gets fresh files on the next scan */
+		if (s->res[U_STAT] <= 0) { uring_close(u, idx); continue; }
+
+		buf = s->iov[U_STAT].iov_base;
+		buf[s->res[U_STAT]] = '\0';
+		if (s->res[U_STATX] == 0) s->uid = s->stx.stx_uid;
+		s->filtered = filter && (!filter_uid(s->uid) || !filter_comm(buf));
+		if (s->filtered) { PROCS_STAT(filtered, 1); continue; }
+		memset(&p[counter], 0, sizeof p[counter]);
+		p[counter].oom_score = -1;
+		p[counter].stat_hash = stat_hash(buf, s->res[U_STAT]);
+#ifdef PIDGRID_STATS
+		{
+			unsigned long long t0 = procs_now_ns();
+			parse(buf, &p[counter]);
+			procs_stats.parse_ns += procs_now_ns() - t0;
+		}
+		procs_stats.procs++;
+#else
+		parse(buf, &p[counter]);
+#endif
+		if (p[counter].tid == 0) continue;
+		p[counter].uid = s->uid;
+		if (filter && !filter_parsed(&p[counter])) {
+			s->filtered = 1;
+			PROCS_STAT(filtered, 1);
+			continue;
+		}
+		if (s->oom_later) oom_later[noom++] = counter;
+		if (s->res[U_OOM] > 0) {
+			buf = s->iov[U_OOM].iov_base;
+			buf[s->res[U_OOM]] = '\0';
+			oomscore2proc(buf, &p[counter]);
+		}
+		if (s->res[U_OOMADJ] > 0) {
+			buf = s->iov[U_OOMADJ].iov_base;
+			buf[s->res[U_OOMADJ]] = '\0';
+			oomadj2proc(buf, &p[counter]);
+		}
+		counter++;
+	}
+
+	/* pids that didn't show up in /proc at all */
+	for (idx=0; idx<URING_SLOTS; idx++)
+		if (u->slots[idx].pid && u->slots[idx].seen != u->scan) uring_close(u, idx);
+
+	/* Ran out of fds: with some given back, finish the slow way.  The
+	   listing picks up at the pid whose open failed. */
+	if (u->starved) {
+		uring_trim(u);
+		for (i=0; i<noom; i++) {
+			snprintf(name, sizeof name, "%d", p[oom_later[i]].tid);
+			simple_readproc_oom(name, &p[oom_later[i]]);
+		}
+		if (resume >= 0) {
+			seekdir(procfs, resume);
+			while (counter < maxprocs && (pdir = readdir(procfs)) != NULL) {
+				PROCS_STAT(scanned, 1);
+				counter += uring_slow_road(u, procfs, pdir->d_name, &p[counter],
+						fields, filter, detail, closure);
+			}
+			u->starved = 0;
+		}
+	}
+
+	return counter;
+}
+#endif /* PROCS_URING */
+
+int procs_set_root(const char *root) {
+	if (strlen(root) >= sizeof proc_root) return -1;
+	strcpy(proc_root, root);
+	if (proc_dir) closedir(proc_dir);
+	proc_dir = NULL;
+#ifdef PROCS_URING
+	/* the ring holds the old root open */
+	if (uring) {
+		uring_free(uring);
+		uring = NULL;
+		procs_use_uring(1);
+	}
+#endif
+	return 0;
+}
+
+/* Gives back what scans keep between them: the /proc DIR and the ring. */
+void procs_close(void) {
+	if (proc_dir) closedir(proc_dir);
+	proc_dir = NULL;
+	procs_use_uring(0);
+}
+
+int procs_use_uring(int on) {
+#ifdef PROCS_URING
+	if (!on) {
+		if (uring) uring_free(uring);
+		uring = NULL;
+		return 0;
+	}
+	if (!uring && !uring_failed && !(uring = uring_init())) uring_failed = 1;
+	return uring != NULL;
+#else
+	return 0;
+#endif
+}
+
 /* returns count of proccess */
 int get_all_procs(proc_t p[], int maxprocs){
+	return get_all_procs_detail(p, maxprocs, PF_ALL, NULL, NULL);
+}
+
+/* As get_all_procs, but only the PF_ fields asked for are parsed, and
+   the oom files are only read for pids that detail() says yes to; the
+   rest come back with oom_score -1. */
+int get_all_procs_detail(proc_t p[], int maxprocs, unsigned fields,
+		proc_detail_fn detail, void *closure){
 	DIR *procfs;
 	struct dirent *pdir;
 	int counter, rc;
+	const struct scan_filter *filter = scan_filter.active ? &scan_filter : NULL;
+
+	if (filter) fields |= filter->fields;
+#ifdef PROCS_URING
+	if (uring) {
+		if ((counter = get_all_procs_uring(p, maxprocs, fields, detail, closure)) >= 0)
+			return counter;
+		/* the ring let us down; stay on plain reads from now on */
+		uring_free(uring);
+		uring = NULL;
+		uring_failed = 1;
+	}
+#endif
 
 	counter = 0;
-	procfs = opendir("/proc");
+	procfs = procs_opendir();
+	if (!procfs) return 0;
 	while ((pdir = readdir(procfs)) != NULL){
+		PROCS_STAT(scanned, 1);
 		/* printf ("counter %i with %s\n", counter, pdir->d_name);  */
-		rc = simple_readproc(pdir->d_name, &p[counter]);
+		rc = readproc_stat_at(dirfd(procfs), pdir->d_name, &p[counter], fields, filter);
 		if (rc == -1) { continue;};
+		if (p[counter].tid == 0) { continue;};
+		if (!detail || detail(p[counter].tid, closure))
+			simple_readproc_oom(pdir->d_name, &p[counter]);
 		/*
 		fprintf(stderr,"readproc rc %i tid %i ppid %i state %c rss %lu oom %i oomadj %i\n",
 				rc, p->tid, p->ppid, p->state, p->rss, p->oom_score, p->oom_adj);
 		*/
-		if (p[counter].tid == 0) { continue;};
 		counter++;
 		if (counter == maxprocs) { break;};
 	}
-	closedir(procfs);
 	return counter;
 }
 
+#ifdef PROCS_BENCH
+#include "allocs.c"
+
+static int bench_no_detail(int pid, void *closure) { return 0; }
+
+int main(int argc, char **argv) {
+	static proc_t p[32768];
+	static const struct { const char *name; unsigned fields; } sets[] = {
+#define X(name, fields) { #name, fields },
+		STAT_FIELDSETS(X)
+#undef X
+	};
+	int iters = argc > 1 ? atoi(argv[1]) : 100;
+	int i, s, n;
+	unsigned long long t;
+	unsigned long allocs, steady_allocs = 0;
+
+	/* stat lines only, so the parsers are what differs */
+	printf("%-8s %6s %12s %12s %12s %12s %8s\n", "fields", "procs",
+			"read B/proc", "parsed B/proc", "parse ns/proc", "scan us", "allocs");
+	for (s=0; s<sizeof sets / sizeof *sets; s++) {
+		get_all_procs_detail(p, 32768, sets[s].fields, bench_no_detail, NULL);
+		memset(&procs_stats, 0, sizeof procs_stats);
+		allocs = allocs_count;
+		n = 0;
+		t = procs_now_ns();
+		for (i=0; i<iters; i++)
+			n += get_all_procs_detail(p, 32768, sets[s].fields,
+					bench_no_detail, NULL);
+		t = procs_now_ns() - t;
+		allocs = allocs_count - allocs;
+		steady_allocs += allocs;
+		if (n == 0) n = 1;
+		printf("%-8s %6d %12.1f %12.1f %12.1f %12.1f %8lu\n", sets[s].name, n / iters,
+				(double) procs_stats.bytes / n, (double) procs_stats.parsed / n,
+				(double) procs_stats.parse_ns / n, t / 1000.0 / iters, allocs);
+	}
+
+	/* everything, oom files included, plain reads against the ring */
+	printf("\n%-8s %6s %12s %12s %12s %8s\n", "backend", "procs",
+			"syscalls", "syscalls/proc", "sample us", "allocs");
+	for (s=0; s<2; s++) {
+		if (procs_use_uring(s) != s) {
+			printf("%-8s unavailable\n", "uring");
+			break;
+		}
+		get_all_procs_detail(p, 32768, PF_ALL, NULL, NULL);  /* warm up */
+		memset(&procs_stats, 0, sizeof procs_stats);
+		allocs = allocs_count;
+		n = 0;
+		t = procs_now_ns();
+		for (i=0; i<iters; i++)
+			n += get_all_procs_detail(p, 32768, PF_ALL, NULL, NULL);
+		t = procs_now_ns() - t;
+		allocs = allocs_count - allocs;
+		steady_allocs += allocs;
+		if (n == 0) n = 1;
+		printf("%-8s %6d %12.1f %12.2f %12.1f %8lu\n", s ? "uring" : "sync", n / iters,
+				(double) procs_stats.syscalls / iters,
+				(double) procs_stats.syscalls / n, t / 1000.0 / iters, allocs);
+	}
+
+	/* after the warm-up sample, sampling must not touch the heap */
+	if (steady_allocs) {
+		fprintf(stderr, "procs-bench: FAIL: %lu heap allocations after warm-up\n",
+				steady_allocs);
+		return 1;
+	}
+	return 0;
+}
+#endif /* PROCS_BENCH */
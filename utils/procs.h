@@ -1,7 +1,21 @@
+#ifndef PROCS_H
+#define PROCS_H
 
-#define PROCPATHLEN 64
+#define PROCPATHLEN 256
 #define buffGRW 1024
 
+/* stat line fields a sampler can ask for */
+#define PF_STATE    0x01
+#define PF_PPID     0x02
+#define PF_TTY      0x04
+#define PF_CPU      0x08    /* utime, stime */
+#define PF_VSIZE    0x10
+#define PF_RSS      0x20
+#define PF_SCHED    0x40    /* rtprio, sched */
+#define PF_COMM     0x80
+#define PF_BASIC    (PF_STATE | PF_VSIZE | PF_RSS)
+#define PF_ALL      0xff
+
 typedef struct proc_t {
 	int
 		tid,        /* task id, aka PID */
@@ -14,15 +28,57 @@ typedef struct proc_t {
 		tty         /* tty */
 		;
 	char
-		state       /* char code for process state */
+		state,      /* char code for process state */
+		comm[16]    /* command name, as far as stat shows it */
 		;	
 	unsigned long
 		vsize,      /* virtual size */
 		rss         /* resident set size */
         ;
+	unsigned long long
+		utime,      /* user mode CPU, clock ticks */
+		stime       /* kernel mode CPU, clock ticks */
+		;
+	unsigned long
+		stat_hash   /* of the raw stat line; the same means unchanged */
 		;
 } proc_t;
 
+#ifdef PIDGRID_STATS
+/* Sampler counters, reset by the caller whenever it likes.
+   Build with -DPIDGRID_STATS to get them; otherwise they cost nothing. */
+struct procs_stats {
+	unsigned long
+		scanned,    /* /proc entries looked at */
+		procs,      /* processes parsed */
+		syscalls,   /* stat/open/read/close/io_uring_*, not getdents */
+		bytes,      /* bytes read out of /proc */
+		parsed,     /* bytes of stat lines the parser walked over */
+		filtered    /* processes the scan filter turned away */
+		;
+	unsigned long long
+		parse_ns    /* time spent inside stat2proc */
+		;
+};
+extern struct procs_stats procs_stats;
+# define PROCS_STAT(field, n) (procs_stats.field += (n))
+#else
+# define PROCS_STAT(field, n) ((void) 0)
+#endif
+
 int stat2name(int pid, char *name);
+typedef int (*proc_detail_fn)(int pid, void *closure);
+
 int get_all_procs(proc_t p[], int maxprocs);
+int get_all_procs_detail(proc_t p[], int maxprocs, unsigned fields,
+		proc_detail_fn detail, void *closure);
+int procs_use_uring(int on);
+int procs_set_filter(const char *spec);
+int procs_set_root(const char *root);
+void procs_close(void);
 int simple_readproc(char *parth, proc_t *p);
+int simple_readproc_stat(char *path, proc_t *p, unsigned fields);
+void simple_readproc_oom(char *path, proc_t *p);
+int simple_readproc_rollup(int pid, unsigned long *pss, unsigned long *uss);
+
+#endif /* PROCS_H */
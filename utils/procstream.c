@@ -0,0 +1,415 @@
+/* procstream.c, Copyright (c) 2022 Robbie Huffman <robbie.huffman@nundrum.net>
+ *
+ * Process tables as a stream of deltas, from pidgrid-agent to
+ * pidgrid -fleet.  See procstream.h for the format.  Like procs.c,
+ * this gets #included by the programs that use it.
+ */
+
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netdb.h>
+
+#include "procstream.h"
+
+/* the fields sent as deltas: PS_ bit, proc_t member */
+#define PS_FIELDS(X) \
+	X(PS_PPID,   ppid) \
+	X(PS_UID,    uid) \
+	X(PS_TTY,    tty) \
+	X(PS_OOM,    oom_score) \
+	X(PS_OOMADJ, oom_adj) \
+	X(PS_RTPRIO, rtprio) \
+	X(PS_SCHED,  sched) \
+	X(PS_VSIZE,  vsize) \
+	X(PS_RSS,    rss) \
+	X(PS_UTIME,  utime) \
+	X(PS_STIME,  stime)
+
+static const proc_t noproc;
+
+static int tid_compare(const void *a, const void *b) {
+	const proc_t *pa = a, *pb = b;
+	return (pa->tid > pb->tid) - (pa->tid < pb->tid);
+}
+
+int pstream_sort(proc_t *p, int n) {
+	qsort(p, n, sizeof *p, tid_compare);
+	return n;
+}
+
+/* grows by half again, so a table creeping up doesn't realloc each frame */
+static int reserve(proc_t **procs, int *cap, int n) {
+	proc_t *grown;
+	if (n <= *cap) return 0;
+	if (n < *cap + *cap / 2) n = *cap + *cap / 2;
+	if (!(grown = realloc(*procs, n * sizeof *grown))) return -1;
+	*procs = grown;
+	*cap = n;
+	return 0;
+}
+
+int pstream_table_set(struct pstream_table *t, const proc_t *p, int n) {
+	if (reserve(&t->procs, &t->cap, n) < 0) return -1;
+	memcpy(t->procs, p, n * sizeof *p);
+	t->n = n;
+	return 0;
+}
+
+void pstream_table_free(struct pstream_table *t) {
+	free(t->procs);
+	free(t->spare);
+	memset(t, 0, sizeof *t);
+}
+
+static unsigned char *put_varint(unsigned char *o, unsigned long long v) {
+	while (v >= 0x80) {
+		*o++ = v | 0x80;
+		v >>= 7;
+	}
+	*o++ = v;
+	return o;
+}
+
+/* zigzag, so small changes either way stay short */
+static unsigned char *put_delta(unsigned char *o, long long now, long long then) {
+	long long d = (long long) ((unsigned long long) now - (unsigned long long) then);
+	return put_varint(o, ((unsigned long long) d << 1) ^ (unsigned long long) (d >> 63));
+}
+
+static const unsigned char *get_varint(const unsigned char *i, const unsigned char *end,
+		unsigned long long *v) {
+	int shift;
+	*v = 0;
+	for (shift = 0; i < end && shift < 64; shift += 7) {
+		*v |= (unsigned long long) (*i & 0x7f) << shift;
+		if (!(*i++ & 0x80)) return i;
+	}
+	return NULL;
+}
+
+static long long undelta(unsigned long long z, long long then) {
+	long long d = (long long) (z >> 1) ^ -(long long) (z & 1);
+	return (long long) ((unsigned long long) then + d);
+}
+
+static void put_le32(unsigned char *o, size_t v) {
+	o[0] = v; o[1] = v >> 8; o[2] = v >> 16; o[3] = v >> 24;
+}
+
+static size_t get_le32(const unsigned char *i) {
+	return i[0] | i[1] << 8 | i[2] << 16 | (size_t) i[3] << 24;
+}
+
+/* worst case for one record is every field at full width */
+size_t pstream_bound(int nprev, int ncur) {
+	return 4 + 1 + 10 + (size_t) (nprev + ncur) * (5 + 3 + 1 + 11 * 10 + 1 + 16);
+}
+
+size_t pstream_encode_hello(unsigned char *out, const char *host) {
+	unsigned char *o = out + 4;
+	size_t len = strlen(host);
+	if (len > 63) len = 63;
+	*o++ = 'H';
+	o = put_varint(o, PSTREAM_VERSION);
+	o = put_varint(o, len);
+	memcpy(o, host, len);
+	o += len;
+	put_le32(out, o - out - 4);
+	return o - out;
+}
+
+/* a record if anything changed; new pids always send their state */
+static unsigned char *put_record(unsigned char *o, int *lastpid,
+		const proc_t *old, const proc_t *p) {
+	unsigned mask = 0;
+	size_t len;
+
+	if (old == &noproc || p->state != old->state) mask |= PS_STATE;
+#define X(bit, f) if (p->f != old->f) mask |= bit;
+	PS_FIELDS(X)
+#undef X
+	if (strncmp(p->comm, old->comm, sizeof p->comm)) mask |= PS_COMM;
+	if (!mask) return o;
+
+	o = put_varint(o, p->tid - *lastpid);
+	*lastpid = p->tid;
+	o = put_varint(o, mask);
+	if (mask & PS_STATE) *o++ = p->state;
+#define X(bit, f) if (mask & bit) o = put_delta(o, p->f, old->f);
+	PS_FIELDS(X)
+#undef X
+	if (mask & PS_COMM) {
+		len = strnlen(p->comm, sizeof p->comm - 1);
+		o = put_varint(o, len);
+		memcpy(o, p->comm, len);
+		o += len;
+	}
+	return o;
+}
+
+/* cur must be in pid order, as must prev (which a full frame ignores);
+   out needs pstream_bound(prev->n, ncur) bytes */
+size_t pstream_encode(unsigned char *out, const struct pstream_table *prev,
+		const proc_t *cur, int ncur, unsigned long seq, int full) {
+	unsigned char *o = out + 4;
+	int i = 0, j = 0, lastpid = 0, nprev = full ? 0 : prev->n;
+
+	*o++ = full ? 'F' : 'D';
+	o = put_varint(o, seq);
+	while (i < nprev || j < ncur) {
+		if (j == ncur || (i < nprev && prev->procs[i].tid < cur[j].tid)) {
+			o = put_varint(o, prev->procs[i++].tid - lastpid);
+			lastpid = prev->procs[i - 1].tid;
+			o = put_varint(o, PS_GONE);
+		} else if (i == nprev || cur[j].tid < prev->procs[i].tid) {
+			o = put_record(o, &lastpid, &noproc, &cur[j++]);
+		} else {
+			o = put_record(o, &lastpid, &prev->procs[i++], &cur[j++]);
+		}
+	}
+	put_le32(out, o - out - 4);
+	return o - out;
+}
+
+/* Applies one frame body to the table: 1 for a table frame, 0 for a
+   hello (host is filled in), -1 if it doesn't make sense. */
+int pstream_decode(struct pstream_table *t, char *host, size_t hostsize,
+		const unsigned char *body, size_t len) {
+	const unsigned char *i = body, *end = body + len;
+	unsigned long long v, mask, pid = 0;
+	proc_t *p, *swap;
+	const proc_t *old;
+	int k = 0, m = 0, full, nold, swapcap;
+
+	if (len < 1) return -1;
+	switch (*i++) {
+		case 'H':
+			if (!(i = get_varint(i, end, &v)) || v != PSTREAM_VERSION) return -1;
+			if (!(i = get_varint(i, end, &v)) || v > end - i) return -1;
+			if (v >= hostsize) v = hostsize - 1;
+			memcpy(host, i, v);
+			host[v] = '\0';
+			return 0;
+		case 'F': full = 1; break;
+		case 'D': full = 0; break;
+		default: return -1;
+	}
+	if (!(i = get_varint(i, end, &v))) return -1;
+	t->seq = v;
+
+	/* every record is at least two bytes */
+	nold = full ? 0 : t->n;
+	if (reserve(&t->spare, &t->sparecap, nold + (end - i) / 2 + 1) < 0) return -1;
+
+	while (i < end) {
+		if (!(i = get_varint(i, end, &v))) return -1;
+		pid += v;
+		if (pid > INT_MAX || !(i = get_varint(i, end, &mask))) return -1;
+		while (k < nold && t->procs[k].tid < pid) t->spare[m++] = t->procs[k++];
+		old = (k < nold && t->procs[k].tid == pid) ? &t->procs[k++] : &noproc;
+		if (mask & PS_GONE) continue;
+
+		p = &t->spare[m++];
+		*p = *old;
+		p->tid = pid;
+		if (mask & PS_STATE) {
+			if (i == end) return -1;
+			p->state = *i++;
+		}
+#define X(bit, f) \
+		if (mask & bit) { \
+			if (!(i = get_varint(i, end, &v))) return -1; \
+			p->f = undelta(v, old->f); \
+		}
+		PS_FIELDS(X)
+#undef X
+		if (mask & PS_COMM) {
+			if (!(i = get_varint(i, end, &v)) || v >= sizeof p->comm || v > end - i)
+				return -1;
+			memcpy(p->comm, i, v);
+			p->comm[v] = '\0';
+			i += v;
+		}
+		PROCS_STAT(procs, 1);
+	}
+	while (k < nold) t->spare[m++] = t->procs[k++];
+
+	swap = t->procs; t->procs = t->spare; t->spare = swap;
+	swapcap = t->cap; t->cap = t->sparecap; t->sparecap = swapcap;
+	t->n = m;
+	return 1;
+}
+
+/* "/path" for a Unix socket, else "[host:]port" */
+int pstream_listen(const char *addr) {
+	struct addrinfo hints, *ai;
+	struct sockaddr_un sun;
+	char host[128];
+	const char *port = addr, *colon;
+	int fd, one = 1;
+
+	if (strchr(addr, '/')) {
+		if (strlen(addr) >= sizeof sun.sun_path) return -1;
+		memset(&sun, 0, sizeof sun);
+		sun.sun_family = AF_UNIX;
+		strcpy(sun.sun_path, addr);
+		unlink(addr);
+		if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) return -1;
+		if (bind(fd, (struct sockaddr *) &sun, sizeof sun) < 0 || listen(fd, 16) < 0) {
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	host[0] = '\0';
+	if ((colon = strrchr(addr, ':'))) {
+		snprintf(host, sizeof host, "%.*s", (int) (colon - addr), addr);
+		port = colon + 1;
+	}
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if (getaddrinfo(*host ? host : NULL, port, &hints, &ai)) return -1;
+	fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+	if (fd >= 0) {
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+		if (bind(fd, ai->ai_addr, ai->ai_addrlen) < 0 || listen(fd, 16) < 0) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(ai);
+	return fd;
+}
+
+/* Name lookup blocks, so it happens here, once, rather than on every
+   retry in the draw loop.  Returns -1 if source doesn't resolve; the
+   connection then stays down. */
+int pstream_conn_init(struct pstream_conn *c, const char *source) {
+	struct addrinfo hints, *ai;
+	struct sockaddr_un *sun = (struct sockaddr_un *) &c->addr;
+	char host[128], port[16];
+	const char *colon;
+
+	memset(c, 0, sizeof *c);
+	snprintf(c->source, sizeof c->source, "%s", source);
+	c->fd = -1;
+
+	if (strchr(source, '/')) {
+		if (strlen(source) >= sizeof sun->sun_path) return -1;
+		sun->sun_family = AF_UNIX;
+		strcpy(sun->sun_path, source);
+		c->addrlen = sizeof *sun;
+		return 0;
+	}
+	snprintf(port, sizeof port, "%d", PSTREAM_PORT);
+	snprintf(host, sizeof host, "%s", source);
+	if ((colon = strrchr(source, ':'))) {
+		snprintf(host, sizeof host, "%.*s", (int) (colon - source), source);
+		snprintf(port, sizeof port, "%s", colon + 1);
+	}
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &ai)) return -1;
+	if (ai->ai_addrlen <= sizeof c->addr) {
+		memcpy(&c->addr, ai->ai_addr, ai->ai_addrlen);
+		c->addrlen = ai->ai_addrlen;
+	}
+	freeaddrinfo(ai);
+	return c->addrlen ? 0 : -1;
+}
+
+/* Starts a non-blocking connect to the address pstream_conn_init
+   found; whether it worked shows up as the first read succeeding or
+   failing. */
+static int conn_open(struct pstream_conn *c) {
+	if (!c->addrlen) return -1;
+	c->fd = socket(c->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (c->fd < 0) return -1;
+	if (connect(c->fd, (struct sockaddr *) &c->addr, c->addrlen) < 0 &&
+			errno != EINPROGRESS) {
+		close(c->fd);
+		c->fd = -1;
+		return -1;
+	}
+	c->len = 0;
+	return 0;
+}
+
+/* the host's rows go away with the connection */
+void pstream_conn_close(struct pstream_conn *c) {
+	if (c->fd >= 0) close(c->fd);
+	c->fd = -1;
+	c->connected = 0;
+	c->len = 0;
+	c->table.n = 0;
+	c->retry = time(NULL) + 2;
+}
+
+/* Reads whatever has arrived and applies every complete frame.
+   Returns the number of table frames applied, or -1 if the connection
+   is down (it retries on its own every couple of seconds). */
+int pstream_conn_poll(struct pstream_conn *c) {
+	unsigned char *grown;
+	size_t flen, off;
+	ssize_t n;
+	int frames = 0, rc;
+
+	if (c->fd < 0) {
+		if (time(NULL) < c->retry) return -1;
+		if (conn_open(c) < 0) {
+			c->retry = time(NULL) + 5;
+			return -1;
+		}
+	}
+
+	for (;;) {
+		if (c->cap - c->len < 65536) {
+			if (c->cap >= PSTREAM_MAXFRAME * 2) break;
+			if (!(grown = realloc(c->buf, c->cap ? c->cap * 2 : 131072))) break;
+			c->buf = grown;
+			c->cap = c->cap ? c->cap * 2 : 131072;
+		}
+		PROCS_STAT(syscalls, 1);
+		n = read(c->fd, c->buf + c->len, c->cap - c->len);
+		if (n > 0) {
+			c->len += n;
+			c->bytes += n;
+			c->connected = 1;
+			PROCS_STAT(bytes, n);
+			continue;
+		}
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0 && errno == EAGAIN) break;
+		pstream_conn_close(c);
+		return -1;
+	}
+
+	for (off = 0; c->len - off >= 4; off += 4 + flen) {
+		flen = get_le32(c->buf + off);
+		if (flen > PSTREAM_MAXFRAME) { pstream_conn_close(c); return -1; }
+		if (c->len - off < 4 + flen) break;
+		rc = pstream_decode(&c->table, c->host, sizeof c->host, c->buf + off + 4, flen);
+		if (rc < 0) { pstream_conn_close(c); return -1; }
+		frames += rc;
+		c->frames += rc;
+	}
+	memmove(c->buf, c->buf + off, c->len - off);
+	c->len -= off;
+	return frames;
+}
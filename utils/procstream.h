@@ -0,0 +1,83 @@
+#ifndef PROCSTREAM_H
+#define PROCSTREAM_H
+
+#include <time.h>
+#include <sys/socket.h>
+#include "procs.h"
+
+/*
+ * The pidgrid agent's wire format.  A stream is a series of frames,
+ * each a 4-byte little-endian length and then a body:
+ *
+ *   'H' version host         who is sending, first thing on a stream
+ *   'F' seq record...        the whole table
+ *   'D' seq record...        changes since the previous frame
+ *
+ * Numbers are LEB128 varints; host is a length and bytes.
+ * A record is a varint pid gap (from the previous record's pid; records
+ * are in pid order), a varint mask of PS_ bits, then each masked field:
+ * state as one byte, comm as a length and bytes, anything else as the
+ * zigzag varint difference from its old value (zero for a new pid).
+ * PS_GONE alone means the pid went away.  Unchanged pids cost nothing.
+ */
+
+#define PSTREAM_VERSION 1
+#define PSTREAM_PORT    7711
+#define PSTREAM_MAXFRAME (8 << 20)
+
+#define PS_GONE    0x0001
+#define PS_STATE   0x0002
+#define PS_PPID    0x0004
+#define PS_UID     0x0008
+#define PS_TTY     0x0010
+#define PS_OOM     0x0020
+#define PS_OOMADJ  0x0040
+#define PS_RTPRIO  0x0080
+#define PS_SCHED   0x0100
+#define PS_VSIZE   0x0200
+#define PS_RSS     0x0400
+#define PS_UTIME   0x0800
+#define PS_STIME   0x1000
+#define PS_COMM    0x2000
+
+/* one host's process table, in pid order */
+struct pstream_table {
+	proc_t *procs;
+	int n, cap;
+	proc_t *spare;		/* the next table, while decoding into it */
+	int sparecap;
+	unsigned long seq;
+};
+
+/* a consumer's connection to one agent */
+struct pstream_conn {
+	char source[128];	/* host:port or a socket path */
+	char host[64];		/* as the agent names itself */
+	struct sockaddr_storage addr;	/* looked up once, by pstream_conn_init */
+	socklen_t addrlen;		/* 0 if source didn't resolve */
+	int fd;
+	int connected;
+	time_t retry;		/* when to try connecting again */
+	unsigned char *buf;
+	size_t len, cap;
+	struct pstream_table table;
+	unsigned long bytes, frames;
+};
+
+int pstream_sort(proc_t *p, int n);
+int pstream_table_set(struct pstream_table *t, const proc_t *p, int n);
+void pstream_table_free(struct pstream_table *t);
+
+size_t pstream_bound(int nprev, int ncur);
+size_t pstream_encode_hello(unsigned char *out, const char *host);
+size_t pstream_encode(unsigned char *out, const struct pstream_table *prev,
+		const proc_t *cur, int ncur, unsigned long seq, int full);
+int pstream_decode(struct pstream_table *t, char *host, size_t hostsize,
+		const unsigned char *body, size_t len);
+
+int pstream_listen(const char *addr);
+int pstream_conn_init(struct pstream_conn *c, const char *source);
+int pstream_conn_poll(struct pstream_conn *c);
+void pstream_conn_close(struct pstream_conn *c);
+
+#endif /* PROCSTREAM_H */